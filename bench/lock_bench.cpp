@@ -0,0 +1,133 @@
+// lock_bench.cpp - contention benchmark for the tracker state in details.cpp
+//
+// Preloads users, groups and files, then runs N threads issuing a mix of
+// read-only (get_file / list_files / list_groups) and mutating
+// (login / upload_file) calls for a fixed time and reports throughput.
+// --global-lock serializes every call behind one mutex, which is how the
+// tracker behaved before the per-structure reader/writer locks.
+//
+// Usage: ./lock_bench [--threads=N] [--seconds=S] [--write-pct=P] [--global-lock]
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <pthread.h>
+
+#include "../server/details.h"
+
+using namespace std;
+
+static const int NUM_USERS = 2000;
+static const int NUM_GROUPS = 50;
+static const int FILES_PER_GROUP = 200;
+static const int PIECES_PER_FILE = 64;
+
+static pthread_mutex_t global_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool use_global_lock = false;
+static atomic<bool> stop_flag(false);
+
+template <typename F>
+static void call(F f)
+{
+    if (use_global_lock) pthread_mutex_lock(&global_mutex);
+    f();
+    if (use_global_lock) pthread_mutex_unlock(&global_mutex);
+}
+
+static string user_name(int i) { return "user" + to_string(i); }
+static string group_name(int i) { return "group" + to_string(i); }
+static string file_name(int i) { return "file" + to_string(i); }
+
+static void preload(const string& hashes)
+{
+    for (int u = 0; u < NUM_USERS; ++u) {
+        create_user(user_name(u), "pw");
+        login(user_name(u), "pw", "127.0.0.1:" + to_string(10000 + u));
+    }
+    for (int g = 0; g < NUM_GROUPS; ++g) {
+        string owner = user_name(g % NUM_USERS);
+        create_group(group_name(g), owner);
+        // every user is a member of every group so any call is authorized
+        for (int u = 0; u < NUM_USERS; ++u) {
+            if (user_name(u) == owner) continue;
+            join_group(group_name(g), user_name(u));
+            accept_request(group_name(g), user_name(u), owner);
+        }
+        for (int f = 0; f < FILES_PER_GROUP; ++f) {
+            upload_file(group_name(g), file_name(f), PIECES_PER_FILE * 512 * 1024, string(40, 'a'), hashes, owner);
+        }
+    }
+}
+
+static void worker(int id, int write_pct, const string& hashes, long* ops)
+{
+    mt19937 rng(id * 7919 + 1);
+    long n = 0;
+    while (!stop_flag.load(memory_order_relaxed)) {
+        string user = user_name(rng() % NUM_USERS);
+        string group = group_name(rng() % NUM_GROUPS);
+        string file = file_name(rng() % FILES_PER_GROUP);
+        int pick = rng() % 100;
+        if (pick < write_pct) {
+            if (pick % 2 == 0) {
+                call([&] { login(user, "pw", "127.0.0.1:9999"); });
+            } else {
+                call([&] { upload_file(group, file, PIECES_PER_FILE * 512 * 1024, string(40, 'a'), hashes, user); });
+            }
+        } else {
+            int r = pick % 10;
+            if (r < 7) {
+                call([&] { get_file(group, file, user); });
+            } else if (r < 9) {
+                call([&] { list_files(group, user); });
+            } else {
+                call([&] { list_groups(); });
+            }
+        }
+        ++n;
+    }
+    *ops = n;
+}
+
+int main(int argc, char* argv[])
+{
+    int threads = max(2, (int)thread::hardware_concurrency());
+    int seconds = 5;
+    int write_pct = 5;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg.rfind("--threads=", 0) == 0) threads = stoi(arg.substr(10));
+        else if (arg.rfind("--seconds=", 0) == 0) seconds = stoi(arg.substr(10));
+        else if (arg.rfind("--write-pct=", 0) == 0) write_pct = stoi(arg.substr(12));
+        else if (arg == "--global-lock") use_global_lock = true;
+        else {
+            cerr << "Usage: ./lock_bench [--threads=N] [--seconds=S] [--write-pct=P] [--global-lock]\n";
+            return 1;
+        }
+    }
+
+    string hashes(PIECES_PER_FILE * DIGEST_BYTES, '\xaa');
+    preload(hashes);
+
+    vector<long> ops(threads, 0);
+    vector<thread> workers;
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < threads; ++i) {
+        workers.emplace_back(worker, i, write_pct, cref(hashes), &ops[i]);
+    }
+    this_thread::sleep_for(chrono::seconds(seconds));
+    stop_flag = true;
+    for (auto& t : workers) t.join();
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    long total = 0;
+    for (long n : ops) total += n;
+    cout << (use_global_lock ? "global-lock" : "rwlock") << " threads=" << threads
+         << " write_pct=" << write_pct << " ops=" << total
+         << " ops/s=" << (long)(total / elapsed) << "\n";
+    return 0;
+}
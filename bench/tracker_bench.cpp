@@ -0,0 +1,440 @@
+// tracker_bench.cpp - synthetic load generator for running trackers
+//
+// Opens --sessions client connections spread over the trackers listed in
+// tracker_info.txt. Each one negotiates framing and logs in as its own user,
+// and the sessions of one driver thread share a group. Sessions are split
+// over --threads driver threads that poll() their sockets; every session
+// keeps one request in flight (closed loop) and picks the next command from
+// a weighted --mix of create_user / login / upload_file / get_file /
+// list_files. Uploads carry --pieces piece hashes. After --seconds the
+// throughput, p50/p99/p999 latency and error replies of each command are
+// reported.
+//
+// Usage: ./tracker_bench <tracker_info_file> [--sessions=N] [--threads=T] [--seconds=S]
+//            [--pieces=P] [--preload=F] [--mix=create_user:5,login:10,upload_file:5,get_file:60,list_files:20]
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "../common/protocol.h"
+
+using namespace std;
+
+enum Op { OP_CREATE_USER, OP_LOGIN, OP_UPLOAD_FILE, OP_GET_FILE, OP_LIST_FILES, NUM_OPS };
+static const char* OP_NAMES[NUM_OPS] = {"create_user", "login", "upload_file", "get_file", "list_files"};
+// start of a successful reply to each command (list_files: see reply_ok)
+static const char* OP_OK_PREFIX[NUM_OPS] = {"User with", "Ok logged in", "File uploaded", "FILEINFO", ""};
+
+// Session setup steps, counted separately when they fail.
+enum SetupStep { SETUP_CONNECT, SETUP_HELLO, SETUP_CREATE_USER, SETUP_LOGIN, SETUP_CREATE_GROUP,
+                 SETUP_UPLOAD_FILE, SETUP_JOIN_GROUP, SETUP_ACCEPT_REQUEST, NUM_SETUP_STEPS };
+static const char* SETUP_NAMES[NUM_SETUP_STEPS] = {"connect", "HELLO", "create_user", "login", "create_group",
+                                                   "upload_file", "join_group", "accept_request"};
+// A group is created on its first session's tracker while the others join
+// through their own, so join_group and accept_request are retried until the
+// step before has been replicated.
+static const int SETUP_RETRIES = 200;
+static const int SETUP_RETRY_MS = 10;
+
+static vector<pair<string, int>> trackers;
+static string run_prefix;
+static int num_pieces = 2000;
+static int preload_files = 20;
+static int op_weights[NUM_OPS] = {5, 10, 5, 60, 20};
+static atomic<bool> stop_flag(false);
+// drivers finish session setup before the timed run starts together
+static atomic<int> ready_threads(0);
+static atomic<bool> start_flag(false);
+static atomic<int> setup_failures[NUM_SETUP_STEPS];
+
+struct Session {
+    int fd = -1;
+    string user;
+    string inbuf;
+    string outbuf;
+    size_t out_sent = 0;
+    Op op = OP_LOGIN;
+    chrono::steady_clock::time_point started;
+};
+
+struct ThreadResult {
+    vector<uint32_t> latency_us[NUM_OPS];
+    uint64_t errors[NUM_OPS] = {};
+};
+
+static int connect_to(const pair<string, int>& tracker)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(tracker.second);
+    inet_pton(AF_INET, tracker.first.c_str(), &addr.sin_addr);
+    if (connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool send_all(int fd, const string& data)
+{
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, 0);
+        if (n <= 0) return false;
+        sent += n;
+    }
+    return true;
+}
+
+// Blocking request/reply used while setting sessions up.
+static bool request(Session& s, const string& cmd, string& reply, bool framed = true)
+{
+    string out;
+    if (framed) {
+        append_frame(out, cmd);
+    } else {
+        out = cmd + "\n";
+    }
+    if (!send_all(s.fd, out)) return false;
+    char buff[16384];
+    while (1) {
+        size_t pos = 0;
+        string_view msg;
+        ExtractStatus st = extract_message(s.inbuf, pos, framed, msg);
+        if (st == EXTRACT_ERROR) return false;
+        if (st == EXTRACT_OK) {
+            reply.assign(msg);
+            s.inbuf.erase(0, pos);
+            return true;
+        }
+        ssize_t r = recv(s.fd, buff, sizeof(buff), 0);
+        if (r <= 0) return false;
+        s.inbuf.append(buff, r);
+    }
+}
+
+static bool starts_with(const string_view& s, const char* prefix)
+{
+    size_t len = strlen(prefix);
+    return s.size() >= len && s.compare(0, len, prefix) == 0;
+}
+
+static bool reply_ok(Op op, const string_view& reply)
+{
+    if (op == OP_LIST_FILES) {
+        // a file listing or "No files in the group"
+        return !starts_with(reply, "Cant") && reply != "Login required";
+    }
+    return starts_with(reply, OP_OK_PREFIX[op]);
+}
+
+// Sends cmd until the reply starts with ok, SETUP_RETRIES times at most.
+static bool request_until(Session& s, const string& cmd, const char* ok, string& reply)
+{
+    for (int attempt = 0; attempt < SETUP_RETRIES; ++attempt) {
+        if (!request(s, cmd, reply)) return false;
+        if (starts_with(reply, ok)) return true;
+        this_thread::sleep_for(chrono::milliseconds(SETUP_RETRY_MS));
+    }
+    return false;
+}
+
+static string upload_command(const string& group, const string& file, const string& hashes)
+{
+    string cmd = "upload_file " + group + " " + file + " " + to_string((uint64_t)num_pieces * 512 * 1024)
+               + " " + string(40, '0') + " " + to_string(num_pieces);
+    cmd += hashes;
+    return cmd;
+}
+
+static Op pick_op(mt19937& rng)
+{
+    int total = 0;
+    for (int w : op_weights) total += w;
+    int r = rng() % max(1, total);
+    for (int i = 0; i < NUM_OPS; ++i) {
+        if (r < op_weights[i]) return (Op)i;
+        r -= op_weights[i];
+    }
+    return OP_GET_FILE;
+}
+
+static void driver(int id, int first_session, int count, ThreadResult* result)
+{
+    mt19937 rng(id * 7919 + 1);
+    string group = run_prefix + "g" + to_string(id);
+    // same piece digests for every upload: only the size of the message matters
+    string hashes;
+    hashes.reserve(num_pieces * 41);
+    for (int p = 0; p < num_pieces; ++p) {
+        char hex[41];
+        snprintf(hex, sizeof(hex), "%08x%032x", p, id);
+        hashes += ' ';
+        hashes += hex;
+    }
+
+    // --- setup: connect, HELLO, create_user, login, join the thread's group ---
+    vector<Session> sessions(count);
+    vector<string> files;
+    string reply;
+    auto fail = [&](Session& s, SetupStep step) {
+        setup_failures[step]++;
+        if (s.fd >= 0) close(s.fd);
+        s.fd = -1;
+    };
+    for (int i = 0; i < count; ++i) {
+        Session& s = sessions[i];
+        s.user = run_prefix + "u" + to_string(first_session + i);
+        s.fd = connect_to(trackers[(first_session + i) % trackers.size()]);
+        if (s.fd < 0) {
+            fail(s, SETUP_CONNECT);
+            continue;
+        }
+        if (!request(s, "HELLO " + to_string(PROTOCOL_VERSION), reply, false)
+            || reply != "HELLO " + to_string(PROTOCOL_VERSION)) {
+            fail(s, SETUP_HELLO);
+            continue;
+        }
+        if (!request(s, "create_user " + s.user + " pw", reply) || !reply_ok(OP_CREATE_USER, reply)) {
+            fail(s, SETUP_CREATE_USER);
+            continue;
+        }
+        if (!request(s, "login " + s.user + " pw 1", reply) || !reply_ok(OP_LOGIN, reply)) {
+            fail(s, SETUP_LOGIN);
+            continue;
+        }
+        if (i == 0) {
+            if (!request(s, "create_group " + group, reply) || !starts_with(reply, "Group ")) {
+                fail(s, SETUP_CREATE_GROUP);
+                continue;
+            }
+            for (int f = 0; f < preload_files; ++f) {
+                string file = "f" + to_string(f);
+                if (request(s, upload_command(group, file, hashes), reply) && reply_ok(OP_UPLOAD_FILE, reply)) {
+                    files.push_back(file);
+                } else {
+                    setup_failures[SETUP_UPLOAD_FILE]++;
+                }
+            }
+        } else if (sessions[0].fd >= 0) {
+            if (!request_until(s, "join_group " + group, "Join request submitted", reply)) {
+                fail(s, SETUP_JOIN_GROUP);
+                continue;
+            }
+            if (!request_until(sessions[0], "accept_request " + group + " " + s.user, "OK request accepted", reply)) {
+                fail(s, SETUP_ACCEPT_REQUEST);
+                continue;
+            }
+        }
+    }
+
+    ready_threads++;
+    while (!start_flag.load()) this_thread::sleep_for(chrono::milliseconds(1));
+
+    // --- timed closed loop ---
+    uint64_t counter = 0;
+    auto issue = [&](Session& s) {
+        s.op = pick_op(rng);
+        string cmd;
+        switch (s.op) {
+        case OP_CREATE_USER:
+            cmd = "create_user " + run_prefix + "n" + to_string(id) + "_" + to_string(counter++) + " pw";
+            break;
+        case OP_LOGIN:
+            cmd = "login " + s.user + " pw 1";
+            break;
+        case OP_UPLOAD_FILE:
+            files.push_back("f" + to_string(id) + "_" + to_string(counter++));
+            cmd = upload_command(group, files.back(), hashes);
+            break;
+        case OP_GET_FILE:
+            cmd = "get_file " + group + " " + (files.empty() ? string("none") : files[rng() % files.size()]);
+            break;
+        default:
+            cmd = "list_files " + group;
+            break;
+        }
+        s.outbuf.clear();
+        s.out_sent = 0;
+        append_frame(s.outbuf, cmd);
+        s.started = chrono::steady_clock::now();
+    };
+
+    vector<pollfd> pfds;
+    vector<Session*> by_index;
+    for (Session& s : sessions) {
+        if (s.fd < 0) continue;
+        fcntl(s.fd, F_SETFL, fcntl(s.fd, F_GETFL, 0) | O_NONBLOCK);
+        issue(s);
+        pfds.push_back({s.fd, POLLOUT, 0});
+        by_index.push_back(&s);
+    }
+
+    char buff[65536];
+    while (!stop_flag.load(memory_order_relaxed) && !pfds.empty()) {
+        if (poll(pfds.data(), pfds.size(), 100) <= 0) continue;
+        for (size_t i = 0; i < pfds.size(); ++i) {
+            if (!pfds[i].revents) continue;
+            Session& s = *by_index[i];
+            if (s.out_sent < s.outbuf.size()) {
+                ssize_t n = send(s.fd, s.outbuf.data() + s.out_sent, s.outbuf.size() - s.out_sent, 0);
+                if (n > 0) s.out_sent += n;
+                pfds[i].events = s.out_sent < s.outbuf.size() ? POLLOUT : POLLIN;
+                continue;
+            }
+            ssize_t r = recv(s.fd, buff, sizeof(buff), 0);
+            if (r <= 0) {
+                // tracker went away: stop polling this session
+                pfds[i].fd = -1;
+                continue;
+            }
+            s.inbuf.append(buff, r);
+            size_t pos = 0;
+            string_view msg;
+            if (extract_message(s.inbuf, pos, true, msg) != EXTRACT_OK) continue;
+            s.inbuf.erase(0, pos);
+            auto us = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - s.started).count();
+            result->latency_us[s.op].push_back((uint32_t)min<int64_t>(us, UINT32_MAX));
+            if (!reply_ok(s.op, msg)) result->errors[s.op]++;
+            issue(s);
+            pfds[i].events = POLLOUT;
+        }
+    }
+    for (Session& s : sessions) {
+        if (s.fd >= 0) close(s.fd);
+    }
+}
+
+static uint32_t percentile(const vector<uint32_t>& sorted, double p)
+{
+    if (sorted.empty()) return 0;
+    size_t idx = min(sorted.size() - 1, (size_t)(p * sorted.size()));
+    return sorted[idx];
+}
+
+static bool parse_mix(const string& spec)
+{
+    fill(op_weights, op_weights + NUM_OPS, 0);
+    stringstream ss(spec);
+    string item;
+    while (getline(ss, item, ',')) {
+        size_t colon = item.find(':');
+        if (colon == string::npos) return false;
+        string name = item.substr(0, colon);
+        int i = 0;
+        while (i < NUM_OPS && name != OP_NAMES[i]) ++i;
+        if (i == NUM_OPS) return false;
+        op_weights[i] = stoi(item.substr(colon + 1));
+    }
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* usage = "Usage: ./tracker_bench <tracker_info_file> [--sessions=N] [--threads=T] [--seconds=S]"
+                        " [--pieces=P] [--preload=F] [--mix=create_user:5,login:10,upload_file:5,get_file:60,list_files:20]\n";
+    if (argc < 2) {
+        cerr << usage;
+        return 1;
+    }
+    int sessions = 1000, threads = 4, seconds = 10;
+    for (int i = 2; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg.rfind("--sessions=", 0) == 0) sessions = stoi(arg.substr(11));
+        else if (arg.rfind("--threads=", 0) == 0) threads = stoi(arg.substr(10));
+        else if (arg.rfind("--seconds=", 0) == 0) seconds = stoi(arg.substr(10));
+        else if (arg.rfind("--pieces=", 0) == 0) num_pieces = stoi(arg.substr(9));
+        else if (arg.rfind("--preload=", 0) == 0) preload_files = stoi(arg.substr(10));
+        else if (arg.rfind("--mix=", 0) == 0 && parse_mix(arg.substr(6))) continue;
+        else {
+            cerr << usage;
+            return 1;
+        }
+    }
+    threads = max(1, min(threads, sessions));
+
+    ifstream infile(argv[1]);
+    string line;
+    while (getline(infile, line)) {
+        string ip;
+        int sync_port, client_port;
+        stringstream ss(line);
+        if (ss >> ip >> sync_port >> client_port) trackers.push_back({ip, client_port});
+    }
+    if (trackers.empty()) {
+        cerr << "[BENCH] No trackers in " << argv[1] << "\n";
+        return 1;
+    }
+
+    // thousands of sessions need more descriptors than the usual soft limit
+    rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    // unique names per run, since trackers keep users and groups
+    run_prefix = "bench" + to_string(getpid()) + "_";
+
+    vector<ThreadResult> results(threads);
+    vector<thread> drivers;
+    int per_thread = sessions / threads, extra = sessions % threads, first = 0;
+    for (int t = 0; t < threads; ++t) {
+        int count = per_thread + (t < extra ? 1 : 0);
+        drivers.emplace_back(driver, t, first, count, &results[t]);
+        first += count;
+    }
+    while (ready_threads.load() < threads) this_thread::sleep_for(chrono::milliseconds(10));
+    start_flag = true;
+    auto start = chrono::steady_clock::now();
+    this_thread::sleep_for(chrono::seconds(seconds));
+    stop_flag = true;
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    for (auto& t : drivers) t.join();
+
+    for (int step = 0; step < NUM_SETUP_STEPS; ++step) {
+        if (setup_failures[step]) {
+            cerr << "[BENCH] " << setup_failures[step] << " failed during setup at " << SETUP_NAMES[step] << "\n";
+        }
+    }
+    cout << "trackers=" << trackers.size() << " sessions=" << sessions << " threads=" << threads
+         << " pieces=" << num_pieces << " seconds=" << seconds << "\n";
+    printf("%-12s %10s %10s %10s %10s %10s %10s\n", "command", "count", "ops/s", "p50_us", "p99_us", "p999_us",
+           "errors");
+    uint64_t total = 0, total_errors = 0;
+    for (int op = 0; op < NUM_OPS; ++op) {
+        vector<uint32_t> all;
+        uint64_t errors = 0;
+        for (auto& r : results) {
+            all.insert(all.end(), r.latency_us[op].begin(), r.latency_us[op].end());
+            errors += r.errors[op];
+        }
+        if (all.empty()) continue;
+        sort(all.begin(), all.end());
+        total += all.size();
+        total_errors += errors;
+        printf("%-12s %10zu %10.0f %10u %10u %10u %10llu\n", OP_NAMES[op], all.size(), all.size() / elapsed,
+               percentile(all, 0.50), percentile(all, 0.99), percentile(all, 0.999), (unsigned long long)errors);
+    }
+    printf("%-12s %10llu %10.0f %43llu\n", "total", (unsigned long long)total, total / elapsed,
+           (unsigned long long)total_errors);
+    return 0;
+}
@@ -5,19 +5,37 @@
 #include <atomic>
 #include <fstream>
 #include <sstream>
+#include <cstring>
+#include <cmath>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#else
+#include <sys/uio.h>
+#endif
 #include <CommonCrypto/CommonDigest.h>
 #include <readline/readline.h>
 #include <readline/history.h>
 #include <mutex>
+#include <condition_variable>
+#include <map>
+#include <set>
+#include <list>
+#include <deque>
+#include <queue>
 #include <unordered_map>
+#include <memory>
 #include <algorithm>
 #include <random>
 
+#include "../common/poller.h"
+#include "../common/protocol.h"
+
 using namespace std;
 
 // --- Globals ---
@@ -25,18 +43,81 @@ vector<pair<string, int>> trackers;
 atomic<int> current_tracker_idx(0);
 // This is the corrected line 27
 static const size_t PIECE_SIZE = 512 * 1024; // As specified in the PDF
+// how often a running download reports its pieces and refreshes its peers
+static const int HAVE_ANNOUNCE_INTERVAL_MS = 1000;
+// Refreshes ask only for swarm changes (get_swarm <version>); every this
+// many a full list is fetched, which also drops peers whose address expired.
+static const int SWARM_FULL_REFRESH_INTERVALS = 30;
+// Persistent peer sessions (REQ_PIECE, see PeerPool): requests kept in
+// flight per connection, connections per seeder, and how long a request
+// may wait for its piece before the connection is dropped.
+static const int PEER_PIPELINE_DEPTH = 4;
+static const int PEER_CONNS_PER_SEEDER = 2;
+static const int PEER_REQUEST_TIMEOUT_SEC = 30;
+// A piece offered by several peers is split into blocks of this size and
+// the blocks are spread across them.
+static const size_t BLOCK_SIZE = 64 * 1024;
+// seeder side: a connection that makes no progress for this long is closed
+static const int PEER_IDLE_TIMEOUT_SEC = 120;
+// A seeder taken for a legacy GET_PIECE-only one is given REQ_PIECE again
+// after this long, in case it was a current seeder restarting.
+static const int PEER_LEGACY_RECHECK_SEC = 60;
+// upper bound on concurrent piece fetches per download
+static const int MAX_DOWNLOAD_WORKERS = 16;
+// a seeder whose requests fail is passed over for this long, doubling
+// with each consecutive failure
+static const int SEEDER_RETRY_BASE_MS = 250;
+static const int SEEDER_RETRY_MAX_MS = 10000;
+// Peer server defaults (--upload-slots / --upload-workers): concurrent
+// upload connections accepted, and threads serving them.
+static int g_upload_slots = 64;
+static int g_upload_workers = 4;
+// seeder fd cache: open files kept, and how often a cached path is
+// re-checked for having been replaced or modified on disk
+static const size_t SEED_FD_CACHE_SIZE = 64;
+static const int SEED_FD_REVALIDATE_MS = 1000;
+// keep well under the tracker's --client-ttl (default 30s)
+static const int HEARTBEAT_INTERVAL_SEC = 10;
 // static const size_t PIECE_SIZE = 512 * 1024; [cite_start]// As specified in the PDF [cite: 34]
 
 // --- FIX: ADD GLOBALS FOR LOGIN STATE ---
 static mutex g_credentials_mtx;
 static string g_currentUser;
 static string g_currentPassword;
+static string g_session_token; // from the login reply ("... TOKEN <hex>")
 static int g_peer_port = 0;
+// Serializes request/reply pairs on the main tracker connection between the
+// command loop and the heartbeat thread.
+static mutex g_main_conn_mtx;
 
 // --- Structs for Local File Seeding and Download Tracking ---
+// Pieces of a file verified so far, bit i (most significant first) for
+// piece i. Shared by the download workers and the peer listener.
+struct PieceBitfield {
+    mutex mtx;
+    string bits;
+
+    explicit PieceBitfield(int num_pieces) : bits((num_pieces + 7) / 8, '\0') {}
+    bool has(int i) {
+        lock_guard<mutex> lock(mtx);
+        return bits[i / 8] & (0x80 >> (i % 8));
+    }
+    void set(int i) {
+        lock_guard<mutex> lock(mtx);
+        bits[i / 8] |= (char)(0x80 >> (i % 8));
+    }
+    string copy() {
+        lock_guard<mutex> lock(mtx);
+        return bits;
+    }
+};
+
 struct LocalFile {
     string path;
     size_t file_size;
+    // set while the file is still downloading into path (the .part file):
+    // only these pieces may be served
+    shared_ptr<PieceBitfield> have;
 };
 static mutex local_files_mtx;
 static unordered_map<string, LocalFile> local_seeding_files; // Key: group_id:filename
@@ -60,6 +141,64 @@ static unordered_map<string, DownloadState> ongoing_downloads; // Key: group_id:
 
 // --- Hashing and Network Utilities ---
 // ... (This section is unchanged) ...
+// One generator per thread, seeded once.
+static mt19937& thread_rng() {
+    thread_local mt19937 rng(random_device{}());
+    return rng;
+}
+
+static bool send_all(int fd, const char* data, size_t len) {
+    size_t sent = 0;
+    while (sent < len) {
+        ssize_t n = send(fd, data + sent, len - sent, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        sent += n;
+    }
+    return true;
+}
+
+static bool recv_all(int fd, char* data, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = recv(fd, data + got, len - got, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        got += n;
+    }
+    return true;
+}
+
+// Sends as much of len bytes of file_fd, from offset, as a non-blocking
+// socket takes right now, straight from the page cache (sendfile); offset
+// and len are advanced past what went out. Returns 1 on progress, 0 if the
+// socket is full, -1 on error or if the file ended early.
+static int send_file_some(int sock_fd, int file_fd, off_t& offset, size_t& len) {
+    while (true) {
+#ifdef __linux__
+        ssize_t n = sendfile(sock_fd, file_fd, &offset, len);
+        if (n > 0) {
+            len -= n;
+            return 1;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        return -1;
+#else
+        // macOS: the byte count goes in and out through sent, and is set
+        // even when the call stops part way
+        off_t sent = len;
+        int rc = sendfile(file_fd, sock_fd, offset, &sent, nullptr, 0);
+        offset += sent;
+        len -= sent;
+        if (sent > 0) return 1;
+        if (rc < 0 && errno == EINTR) continue;
+        if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        return -1;
+#endif
+    }
+}
+
 string bytes_to_hex(const unsigned char* d, size_t n) {
     static const char hex[] = "0123456789abcdef";
     string s; s.reserve(n * 2);
@@ -70,6 +209,23 @@ string bytes_to_hex(const unsigned char* d, size_t n) {
     return s;
 }
 
+bool hex_to_bytes(const string& hex, string& out) {
+    auto nibble = [](char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    };
+    if (hex.size() % 2 != 0) return false;
+    out.clear();
+    for (size_t i = 0; i < hex.size(); i += 2) {
+        int hi = nibble(hex[i]), lo = nibble(hex[i + 1]);
+        if (hi < 0 || lo < 0) return false;
+        out.push_back((char)((hi << 4) | lo));
+    }
+    return true;
+}
+
 string sha1_hex_of_buffer(const void* data, size_t len) {
     unsigned char digest[CC_SHA1_DIGEST_LENGTH];
     CC_SHA1(data, (CC_LONG)len, digest);
@@ -130,67 +286,510 @@ bool compute_file_hashes(const string& path, size_t& file_size, string& whole_sh
     return true;
 }
 
+// Whole-file SHA-1 of a download, computed as its pieces land instead of
+// in a second pass over the finished file. SHA-1 needs the bytes in
+// order, so the digest covers the longest run of pieces done from the
+// start. The thread that completes the next piece in that run hashes it
+// from its own buffer. Pieces that arrived out of order are read back
+// with pread once the run reaches them, while they are still in the page
+// cache. One thread hashes at a time; others flag that there is more and
+// go back to fetching instead of queueing on the lock.
+class RunningFileHash {
+public:
+    RunningFileHash(int fd, size_t file_size, shared_ptr<PieceBitfield> have)
+        : fd(fd), file_size(file_size), num_pieces((file_size + PIECE_SIZE - 1) / PIECE_SIZE), have(move(have)) {
+        CC_SHA1_Init(&ctx);
+    }
+
+    // Piece idx (data) was written and marked in have.
+    void piece_done(int idx, const vector<char>& data) {
+        more.store(true);
+        while (more.load() && mtx.try_lock()) {
+            more.store(false);
+            drain(idx, &data);
+            mtx.unlock();
+        }
+    }
+
+    // Hashes whatever is left (all pieces must be in) and returns the hex
+    // digest; empty if a piece could not be read back.
+    string finish() {
+        lock_guard<mutex> lock(mtx);
+        if (!drain(-1, nullptr) || next < num_pieces) return "";
+        unsigned char wd[CC_SHA1_DIGEST_LENGTH];
+        CC_SHA1_Final(wd, &ctx);
+        return bytes_to_hex(wd, CC_SHA1_DIGEST_LENGTH);
+    }
+
+private:
+    // Extends the hashed run over every piece already in. Caller holds mtx.
+    bool drain(int idx, const vector<char>* data) {
+        vector<char> buf;
+        while (next < num_pieces && have->has(next)) {
+            if (next == idx) {
+                CC_SHA1_Update(&ctx, data->data(), (CC_LONG)data->size());
+            } else {
+                off_t offset = (off_t)next * PIECE_SIZE;
+                size_t len = min((size_t)PIECE_SIZE, file_size - (size_t)offset);
+                buf.resize(len);
+                if (pread(fd, buf.data(), len, offset) != (ssize_t)len) return false;
+                CC_SHA1_Update(&ctx, buf.data(), (CC_LONG)len);
+            }
+            next++;
+        }
+        return true;
+    }
+
+    int fd;
+    size_t file_size;
+    int num_pieces;
+    shared_ptr<PieceBitfield> have;
+    mutex mtx;
+    atomic<bool> more{false};
+    CC_SHA1_CTX ctx;
+    int next = 0; // pieces before this are hashed
+};
 
 
 // --- Peer-to-Peer Listener (Seeder) Logic ---
 // ... (This section is unchanged) ...
-void handle_peer_connection(int cfd) {
-    char buffer[1024];
-    ssize_t n = recv(cfd, buffer, sizeof(buffer) - 1, 0);
-    if (n <= 0) {
-        close(cfd);
-        return;
+// A shared file kept open for serving, with its local_seeding_files entry
+// and the identity of the file the descriptor was opened on.
+struct SeedFile {
+    LocalFile info;
+    int fd = -1;
+    struct stat st {};
+    chrono::steady_clock::time_point checked;
+
+    ~SeedFile() { if (fd >= 0) close(fd); }
+};
+
+// Bounded LRU of SeedFiles by "group:file" key, so serving a piece costs
+// neither an open()/close() nor a local_files_mtx lookup. An entry goes
+// when its local_seeding_files entry changes (set_local_file and
+// erase_local_file invalidate it) and is reopened when a periodic stat()
+// shows the path now names a different or modified file. Evicted entries
+// stay open until the last request using them is done.
+class SeedFileCache {
+public:
+    shared_ptr<SeedFile> get(const string& key) {
+        uint64_t gen;
+        {
+            lock_guard<mutex> lock(mtx);
+            auto it = index.find(key);
+            if (it != index.end()) {
+                shared_ptr<SeedFile> file = it->second->second;
+                if (still_valid(*file)) {
+                    lru.splice(lru.begin(), lru, it->second);
+                    return file;
+                }
+                lru.erase(it->second);
+                index.erase(it);
+            }
+            gen = generation;
+        }
+
+        auto file = make_shared<SeedFile>();
+        {
+            lock_guard<mutex> lock(local_files_mtx);
+            auto it = local_seeding_files.find(key);
+            if (it == local_seeding_files.end()) return nullptr;
+            file->info = it->second;
+        }
+        file->fd = open(file->info.path.c_str(), O_RDONLY);
+        if (file->fd < 0 || fstat(file->fd, &file->st) != 0) return nullptr;
+        file->checked = chrono::steady_clock::now();
+
+        lock_guard<mutex> lock(mtx);
+        // an invalidation since the lookup means file->info may be stale:
+        // serve this one request from it, but do not cache it
+        if (gen != generation) return file;
+        auto it = index.find(key);
+        if (it != index.end()) return it->second->second; // lost a race to another opener
+        lru.emplace_front(key, file);
+        index[key] = lru.begin();
+        if (lru.size() > SEED_FD_CACHE_SIZE) {
+            index.erase(lru.back().first);
+            lru.pop_back();
+        }
+        return file;
     }
-    buffer[n] = '\0';
-    
-    stringstream ss(buffer);
-    string command, group_id, filename;
-    int piece_idx;
-    ss >> command >> group_id >> filename >> piece_idx;
 
-    if (command != "GET_PIECE" || group_id.empty() || filename.empty() || piece_idx < 0) {
-        close(cfd);
-        return;
+    void invalidate(const string& key) {
+        lock_guard<mutex> lock(mtx);
+        generation++;
+        auto it = index.find(key);
+        if (it == index.end()) return;
+        lru.erase(it->second);
+        index.erase(it);
+    }
+
+private:
+    // Caller holds mtx.
+    static bool still_valid(SeedFile& file) {
+        auto now = chrono::steady_clock::now();
+        if (now - file.checked < chrono::milliseconds(SEED_FD_REVALIDATE_MS)) return true;
+        struct stat st;
+        if (stat(file.info.path.c_str(), &st) != 0) return false;
+        if (st.st_dev != file.st.st_dev || st.st_ino != file.st.st_ino) return false;
+        // a .part file is written by our own download while it is served
+        if (!file.info.have && (st.st_size != file.st.st_size || st.st_mtime != file.st.st_mtime)) return false;
+        file.checked = now;
+        return true;
     }
 
-    string key = group_id + ":" + filename;
-    LocalFile file_info;
+    mutex mtx;
+    list<pair<string, shared_ptr<SeedFile>>> lru; // most recently used first
+    unordered_map<string, list<pair<string, shared_ptr<SeedFile>>>::iterator> index;
+    uint64_t generation = 0;
+};
+static SeedFileCache seed_files;
+
+// All changes to local_seeding_files go through these two, which keep the
+// seeder fd cache in step.
+static void set_local_file(const string& key, const LocalFile& file) {
     {
         lock_guard<mutex> lock(local_files_mtx);
-        if (!local_seeding_files.count(key)) {
-            close(cfd);
-            return;
+        local_seeding_files[key] = file;
+    }
+    seed_files.invalidate(key);
+}
+
+static void erase_local_file(const string& key) {
+    {
+        lock_guard<mutex> lock(local_files_mtx);
+        local_seeding_files.erase(key);
+    }
+    seed_files.invalidate(key);
+}
+
+// Finds the open file holding piece idx of a file we share, with the
+// piece's offset and length; null if we do not have the piece (unknown
+// file, out of range, or not downloaded and verified yet).
+static shared_ptr<SeedFile> open_local_piece(const string& group_id, const string& filename, int piece_idx, off_t& offset, size_t& piece_len) {
+    shared_ptr<SeedFile> file = seed_files.get(group_id + ":" + filename);
+    if (!file) return nullptr;
+
+    const LocalFile& file_info = file->info;
+    offset = (off_t)piece_idx * PIECE_SIZE;
+    if (piece_idx < 0 || offset >= (off_t)file_info.file_size || (file_info.have && !file_info.have->has(piece_idx))) {
+        return nullptr;
+    }
+    piece_len = std::min((size_t)PIECE_SIZE, (size_t)(file_info.file_size - offset));
+    return file;
+}
+
+// A connection either carries one legacy "GET_PIECE <group> <file> <piece>"
+// (answered with <len:u32><data> and closed) or is a persistent session of
+// newline-terminated "REQ_PIECE <id> <group> <file> <piece>" and
+// "REQ_BLOCK <id> <group> <file> <piece> <offset> <len>" requests (the
+// latter for a byte range within the piece), answered in order with
+// <id:u32><len:u32><data>; len 0 means we do not have that piece or range.
+// "CANCEL <id>" withdraws a request not yet answered. A connection over
+// --upload-slots gets the single header <0><PEER_BUSY> and is closed: the
+// downloader should back off and retry (old clients read it as length 0).
+// All integers are in network byte order.
+//
+// The seeder side is event driven: peer_listener_thread waits for
+// readiness on every upload connection (common/poller.h) and hands ready
+// ones to a fixed pool of workers. Each connection is a small state machine
+// over a non-blocking socket: send the pending reply header, then the piece
+// body (sendfile), then parse the next buffered request, reading more only
+// when none is complete. Piece data never passes through user space.
+// A connection left waiting (parked) for PEER_IDLE_TIMEOUT_SEC is closed by
+// the listener, so an idle client cannot hold an upload slot forever.
+struct PeerConn {
+    int fd = -1;
+    string inbuf;
+    string outbuf;                // reply header not yet sent
+    shared_ptr<SeedFile> file;    // piece body being sent
+    off_t body_offset = 0;
+    size_t body_left = 0;
+    bool started = false;         // first request seen
+    bool legacy = false;          // GET_PIECE: close once the reply is out
+    bool eof = false;             // peer closed its side
+    // under peer_conns_mtx:
+    bool parked = true;           // in the poller, no worker has it
+    chrono::steady_clock::time_point last_active;
+};
+
+// longest request line we accept
+static const size_t PEER_MAX_REQUEST = 4096;
+// reply length meaning "all upload slots taken, try later"
+static const uint32_t PEER_BUSY = 0xFFFFFFFF;
+
+static Poller peer_poller;
+static int peer_listen_fd = -1;
+static char peer_listen_tag;      // poller tag of the listening socket
+static atomic<int> active_uploads(0);
+
+static mutex peer_ready_mtx;
+static condition_variable peer_ready_cv;
+static deque<PeerConn*> peer_ready;
+
+// every open upload connection, for the idle sweep
+static mutex peer_conns_mtx;
+static set<PeerConn*> peer_conns;
+
+// Hands conn back to the poller until it is ready again; from here on it
+// counts as idle. The rearm happens under peer_conns_mtx so the sweep
+// cannot close the connection halfway through.
+static void park_peer_conn(PeerConn* conn, bool want_write) {
+    lock_guard<mutex> lock(peer_conns_mtx);
+    conn->parked = true;
+    conn->last_active = chrono::steady_clock::now();
+    peer_poller.rearm(conn->fd, conn, want_write);
+}
+
+static void close_peer_conn(PeerConn* conn) {
+    {
+        lock_guard<mutex> lock(peer_conns_mtx);
+        peer_conns.erase(conn);
+    }
+    peer_poller.remove(conn->fd);
+    close(conn->fd);
+    delete conn;
+    active_uploads--;
+}
+
+// Drops the requests named by buffered "CANCEL <id>" lines (a downloader
+// that already got the piece elsewhere), along with the CANCEL lines.
+// Requests already answered or being sent are not affected.
+static void apply_peer_cancels(PeerConn* conn) {
+    if (conn->inbuf.find("CANCEL ") == string::npos) return;
+    size_t complete = conn->inbuf.rfind('\n') + 1;
+    vector<string> lines;
+    set<string> cancelled;
+    stringstream in(conn->inbuf.substr(0, complete));
+    string line;
+    while (getline(in, line)) {
+        if (line.compare(0, 7, "CANCEL ") == 0) {
+            cancelled.insert(line.substr(7));
+        } else {
+            lines.push_back(line);
         }
-        file_info = local_seeding_files[key];
     }
-    
-    off_t offset = (off_t)piece_idx * PIECE_SIZE;
-    if (offset >= (off_t)file_info.file_size) {
-        close(cfd);
-        return;
+    string kept;
+    for (const string& l : lines) {
+        // "REQ_PIECE <id> ..."
+        size_t id_start = l.find(' ') + 1, id_end = l.find(' ', id_start);
+        if (id_start != 0 && cancelled.count(l.substr(id_start, id_end - id_start))) continue;
+        kept += l;
+        kept += '\n';
     }
+    conn->inbuf = kept + conn->inbuf.substr(complete);
+}
 
-    int file_fd = open(file_info.path.c_str(), O_RDONLY);
-    if (file_fd < 0) {
-        close(cfd);
-        return;
+// Queues the reply to the next complete request in inbuf. Returns 1 if a
+// reply was queued, 0 if more input is needed, -1 on a protocol error.
+static int next_peer_request(PeerConn* conn) {
+    off_t offset = 0;
+    size_t piece_len = 0;
+
+    if (!conn->started && conn->inbuf.compare(0, 9, "GET_PIECE") == 0) {
+        // legacy senders write the whole request at once, without a newline
+        conn->started = true;
+        conn->legacy = true;
+        stringstream ss(conn->inbuf);
+        conn->inbuf.clear();
+        string command, group_id, filename;
+        int piece_idx = -1;
+        ss >> command >> group_id >> filename >> piece_idx;
+        if (group_id.empty() || filename.empty()) return -1;
+        conn->file = open_local_piece(group_id, filename, piece_idx, offset, piece_len);
+        if (!conn->file) return -1; // the old protocol signals "no" by closing
+        uint32_t net_len = htonl(piece_len);
+        conn->outbuf.assign((const char*)&net_len, sizeof(net_len));
+        conn->body_offset = offset;
+        conn->body_left = piece_len;
+        return 1;
     }
 
-    size_t piece_len = std::min((size_t)PIECE_SIZE, (size_t)(file_info.file_size - offset));
-    vector<char> piece_data(piece_len);
-    
-    if (pread(file_fd, piece_data.data(), piece_len, offset) != (ssize_t)piece_len) {
-        close(file_fd);
-        close(cfd);
+    apply_peer_cancels(conn);
+    size_t eol = conn->inbuf.find('\n');
+    if (eol == string::npos) return conn->inbuf.size() > PEER_MAX_REQUEST ? -1 : 0;
+    conn->started = true;
+    stringstream ss(conn->inbuf.substr(0, eol));
+    conn->inbuf.erase(0, eol + 1);
+    string command, group_id, filename;
+    uint32_t req_id = 0;
+    int piece_idx = -1;
+    ss >> command >> req_id >> group_id >> filename >> piece_idx;
+    if ((command != "REQ_PIECE" && command != "REQ_BLOCK") || ss.fail()) return -1;
+
+    conn->file = open_local_piece(group_id, filename, piece_idx, offset, piece_len);
+    if (command == "REQ_BLOCK") {
+        size_t block_offset = 0, block_len = 0;
+        ss >> block_offset >> block_len;
+        if (ss.fail()) return -1;
+        if (block_offset >= piece_len || block_len == 0 || block_len > piece_len - block_offset) {
+            conn->file = nullptr;
+        }
+        offset += block_offset;
+        piece_len = block_len;
+    }
+    uint32_t header[2] = {htonl(req_id), htonl(conn->file ? (uint32_t)piece_len : 0)};
+    conn->outbuf.assign((const char*)header, sizeof(header));
+    conn->body_offset = offset;
+    conn->body_left = conn->file ? piece_len : 0;
+    return 1;
+}
+
+// Reads what is available; returns 1 if any input arrived. EOF and errors
+// set conn->eof.
+static int fill_peer_input(PeerConn* conn) {
+    char chunk[4096];
+    int got = 0;
+    while (conn->inbuf.size() <= PEER_MAX_REQUEST) {
+        ssize_t n = recv(conn->fd, chunk, sizeof(chunk), 0);
+        if (n > 0) {
+            conn->inbuf.append(chunk, n);
+            got = 1;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return got;
+        conn->eof = true;
+        return got;
+    }
+    return got;
+}
+
+// Runs one connection until it would block, then rearms it (or closes it).
+static void service_peer_conn(PeerConn* conn) {
+    while (true) {
+        while (!conn->outbuf.empty()) {
+            ssize_t n = send(conn->fd, conn->outbuf.data(), conn->outbuf.size(), 0);
+            if (n > 0) {
+                conn->outbuf.erase(0, n);
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                park_peer_conn(conn, true);
+                return;
+            }
+            close_peer_conn(conn);
+            return;
+        }
+        if (conn->body_left > 0) {
+            int r = send_file_some(conn->fd, conn->file->fd, conn->body_offset, conn->body_left);
+            if (r < 0) {
+                close_peer_conn(conn);
+                return;
+            }
+            if (r == 0) {
+                park_peer_conn(conn, true);
+                return;
+            }
+            if (conn->body_left > 0) continue;
+        }
+        conn->file.reset();
+        if (conn->legacy) {
+            close_peer_conn(conn);
+            return;
+        }
+
+        // pick up any CANCEL sent while the last reply went out
+        if (!conn->eof) fill_peer_input(conn);
+        int r = next_peer_request(conn);
+        if (r < 0) {
+            close_peer_conn(conn);
+            return;
+        }
+        if (r > 0) continue;
+
+        // no complete request buffered: read more, or wait for it
+        if (!conn->eof && fill_peer_input(conn) > 0) continue;
+        if (conn->eof) {
+            close_peer_conn(conn);
+            return;
+        }
+        park_peer_conn(conn, false);
         return;
     }
-    close(file_fd);
-    
-    uint32_t net_len = htonl(piece_len);
-    send(cfd, &net_len, sizeof(net_len), 0);
-    send(cfd, piece_data.data(), piece_len, 0);
-    
-    close(cfd);
+}
+
+static void peer_worker() {
+    while (true) {
+        PeerConn* conn;
+        {
+            unique_lock<mutex> lock(peer_ready_mtx);
+            peer_ready_cv.wait(lock, [] { return !peer_ready.empty(); });
+            conn = peer_ready.front();
+            peer_ready.pop_front();
+        }
+        service_peer_conn(conn);
+    }
+}
+
+// Accepts every pending connection; beyond --upload-slots they get the busy
+// reply and are closed at once, so the downloader moves on to another
+// seeder instead of waiting.
+static void accept_peers() {
+    while (true) {
+        int client_fd = accept(peer_listen_fd, nullptr, nullptr);
+        if (client_fd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("peer accept");
+            break;
+        }
+        if (active_uploads.load() >= g_upload_slots) {
+            uint32_t busy[2] = {0, htonl(PEER_BUSY)};
+            send(client_fd, busy, sizeof(busy), 0);
+            // let the reply go out before the FIN; closing with the request
+            // still unread would reset the connection instead
+            shutdown(client_fd, SHUT_WR);
+            char drain[512];
+            recv(client_fd, drain, sizeof(drain), MSG_DONTWAIT);
+            close(client_fd);
+            continue;
+        }
+        set_nonblocking(client_fd);
+        int opt = 1;
+        // reaps connections of downloaders that vanished without a FIN
+        setsockopt(client_fd, SOL_SOCKET, SO_KEEPALIVE, &opt, sizeof(opt));
+        PeerConn* conn = new PeerConn();
+        conn->fd = client_fd;
+        conn->last_active = chrono::steady_clock::now();
+        active_uploads++;
+        lock_guard<mutex> lock(peer_conns_mtx);
+        if (!peer_poller.add(client_fd, conn)) {
+            perror("peer poller add");
+            close(client_fd);
+            delete conn;
+            active_uploads--;
+            continue;
+        }
+        peer_conns.insert(conn);
+    }
+    peer_poller.rearm(peer_listen_fd, &peer_listen_tag, false);
+}
+
+// Closes connections parked longer than PEER_IDLE_TIMEOUT_SEC: downloaders
+// that stopped sending requests, or stopped reading the reply. Runs on the
+// listener thread between waits, so none of them has an event in hand.
+static void sweep_idle_peers() {
+    auto cutoff = chrono::steady_clock::now() - chrono::seconds(PEER_IDLE_TIMEOUT_SEC);
+    vector<PeerConn*> expired;
+    {
+        lock_guard<mutex> lock(peer_conns_mtx);
+        for (auto it = peer_conns.begin(); it != peer_conns.end();) {
+            PeerConn* conn = *it;
+            if (!conn->parked || conn->last_active > cutoff) {
+                ++it;
+                continue;
+            }
+            peer_poller.remove(conn->fd);
+            expired.push_back(conn);
+            it = peer_conns.erase(it);
+        }
+    }
+    for (PeerConn* conn : expired) {
+        close(conn->fd);
+        delete conn;
+        active_uploads--;
+    }
 }
 
 void peer_listener_thread(int listen_port) {
@@ -212,35 +811,66 @@ void peer_listener_thread(int listen_port) {
         close(server_fd);
         return;
     }
-    if (listen(server_fd, 10) < 0) {
+    if (listen(server_fd, SOMAXCONN) < 0) {
         perror("peer listen");
         close(server_fd);
         return;
     }
+    peer_listen_fd = server_fd;
+    set_nonblocking(server_fd);
+    if (!peer_poller.ok() || !peer_poller.add(server_fd, &peer_listen_tag)) {
+        perror("peer poller");
+        close(server_fd);
+        return;
+    }
+    for (int i = 0; i < max(1, g_upload_workers); ++i) {
+        thread(peer_worker).detach();
+    }
     cout << "[PEER] Listening for other clients on port " << listen_port << "\n";
 
+    PollEvent events[128];
+    auto last_sweep = chrono::steady_clock::now();
     while (true) {
-        int client_fd = accept(server_fd, nullptr, nullptr);
-        if (client_fd < 0) {
-            perror("peer accept");
+        // wake at least once a second for the idle sweep
+        int n = peer_poller.wait(events, 128, 1000);
+        if (n < 0) {
+            perror("peer poller wait");
             continue;
         }
-        thread(handle_peer_connection, client_fd).detach();
+        for (int i = 0; i < n; ++i) {
+            if (events[i].data == &peer_listen_tag) {
+                accept_peers();
+                continue;
+            }
+            PeerConn* conn = (PeerConn*)events[i].data;
+            {
+                lock_guard<mutex> lock(peer_conns_mtx);
+                conn->parked = false;
+            }
+            lock_guard<mutex> lock(peer_ready_mtx);
+            peer_ready.push_back(conn);
+            peer_ready_cv.notify_one();
+        }
+        auto now = chrono::steady_clock::now();
+        if (now - last_sweep >= chrono::seconds(1)) {
+            last_sweep = now;
+            sweep_idle_peers();
+        }
     }
-    close(server_fd);
 }
 
 // --- Peer-to-Peer Downloader Logic ---
 // ... (This section is unchanged) ...
-bool download_piece_from_seeder(const string& seeder_addr, const string& group, const string& filename, int idx, vector<char>& out_data) {
+// Opens a TCP connection to a peer's "ip:port"; -1 on failure.
+static int connect_to_peer(const string& seeder_addr) {
     size_t colon_pos = seeder_addr.find(':');
-    if (colon_pos == string::npos) return false;
+    if (colon_pos == string::npos) return -1;
 
     string ip = seeder_addr.substr(0, colon_pos);
-    int port = stoi(seeder_addr.substr(colon_pos + 1));
+    int port = atoi(seeder_addr.c_str() + colon_pos + 1);
 
     int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock_fd < 0) return false;
+    if (sock_fd < 0) return -1;
 
     sockaddr_in addr{};
     addr.sin_family = AF_INET;
@@ -249,14 +879,26 @@ bool download_piece_from_seeder(const string& seeder_addr, const string& group,
 
     if (connect(sock_fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
         close(sock_fd);
-        return false;
+        return -1;
     }
+    // requests are small lines written while earlier replies are still
+    // arriving; Nagle would hold each back until the seeder's delayed ACK
+    int opt = 1;
+    setsockopt(sock_fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    return sock_fd;
+}
+
+// One-shot GET_PIECE on its own connection, for seeders that predate
+// REQ_PIECE sessions.
+bool download_piece_from_seeder(const string& seeder_addr, const string& group, const string& filename, int idx, vector<char>& out_data) {
+    int sock_fd = connect_to_peer(seeder_addr);
+    if (sock_fd < 0) return false;
 
     string request = "GET_PIECE " + group + " " + filename + " " + to_string(idx);
     send(sock_fd, request.c_str(), request.length(), 0);
 
     uint32_t net_len;
-    if (recv(sock_fd, &net_len, sizeof(net_len), 0) != sizeof(net_len)) {
+    if (!recv_all(sock_fd, (char*)&net_len, sizeof(net_len))) {
         close(sock_fd);
         return false;
     }
@@ -267,24 +909,568 @@ bool download_piece_from_seeder(const string& seeder_addr, const string& group,
     }
 
     out_data.resize(piece_len);
-    ssize_t total_read = 0;
-    while(total_read < piece_len) {
-        ssize_t n = recv(sock_fd, out_data.data() + total_read, piece_len - total_read, 0);
-        if (n <= 0) {
-            close(sock_fd);
+    bool ok = recv_all(sock_fd, out_data.data(), piece_len);
+    close(sock_fd);
+    return ok;
+}
+
+// A persistent REQ_PIECE connection to one seeder (protocol described at
+// PeerConn). Any number of workers may have requests in flight on it; a
+// reader thread matches the replies to them by id. start() sends a request
+// and returns at once, so one worker can have blocks of a piece pending on
+// several sessions; wait() collects the reply.
+struct PeerSession {
+    struct Pending {
+        uint32_t id = 0;
+        int piece = -1;
+        vector<char> data;
+        bool done = false;
+        bool ok = false;
+        bool cancelled = false;
+        chrono::steady_clock::time_point sent, arrived;
+    };
+
+    int fd = -1;
+    mutex mtx;
+    condition_variable cv;
+    uint32_t next_id = 1;
+    unordered_map<uint32_t, shared_ptr<Pending>> pending;
+    bool broken = false;
+    bool answered = false; // has replied at least once, so it speaks REQ_PIECE
+    bool busy = false;     // the seeder was out of upload slots
+    // closed by the seeder without a byte in reply to our first request:
+    // what a seeder that only knows GET_PIECE does
+    bool refused = false;
+
+    // Reads replies until the connection fails, then fails whatever is
+    // still pending. The fd is only closed here, after broken is set.
+    static void reader(shared_ptr<PeerSession> self) {
+        vector<char> body;
+        bool clean_eof = false;
+        while (true) {
+            uint32_t header[2];
+            ssize_t n;
+            do {
+                n = recv(self->fd, (char*)header, 1, MSG_PEEK);
+            } while (n < 0 && errno == EINTR);
+            if (n == 0) clean_eof = true;
+            if (n <= 0 || !recv_all(self->fd, (char*)header, sizeof(header))) break;
+            uint32_t id = ntohl(header[0]), len = ntohl(header[1]);
+            if (id == 0 && len == PEER_BUSY) {
+                lock_guard<mutex> lock(self->mtx);
+                self->busy = true;
+                break;
+            }
+            if (len > PIECE_SIZE) break;
+            body.resize(len);
+            if (!recv_all(self->fd, body.data(), len)) break;
+
+            lock_guard<mutex> lock(self->mtx);
+            self->answered = true;
+            auto it = self->pending.find(id);
+            if (it == self->pending.end()) continue; // its waiter timed out
+            it->second->data.swap(body);
+            it->second->arrived = chrono::steady_clock::now();
+            it->second->ok = len > 0;
+            it->second->done = true;
+            self->pending.erase(it);
+            self->cv.notify_all();
+        }
+        {
+            lock_guard<mutex> lock(self->mtx);
+            // broken already set means we shut it down ourselves
+            self->refused = clean_eof && !self->broken && !self->answered;
+            self->broken = true;
+            for (auto& p : self->pending) p.second->done = true;
+            self->pending.clear();
+            self->cv.notify_all();
+        }
+        close(self->fd);
+    }
+
+    size_t in_flight() {
+        lock_guard<mutex> lock(mtx);
+        return pending.size();
+    }
+
+    bool has_pending(int idx) {
+        lock_guard<mutex> lock(mtx);
+        for (const auto& p : pending) {
+            if (p.second->piece == idx) return true;
+        }
+        return false;
+    }
+
+    // Fails the waiting requests for piece idx and tells the seeder to
+    // drop them if it has not started on them yet (CANCEL <id>).
+    void cancel(int idx) {
+        lock_guard<mutex> lock(mtx);
+        if (broken) return;
+        string lines;
+        for (auto it = pending.begin(); it != pending.end();) {
+            if (it->second->piece != idx) {
+                ++it;
+                continue;
+            }
+            lines += "CANCEL " + to_string(it->first) + "\n";
+            it->second->done = true;
+            it->second->cancelled = true;
+            it = pending.erase(it);
+        }
+        if (lines.empty()) return;
+        cv.notify_all();
+        if (!send_all(fd, lines.data(), lines.size())) {
+            broken = true;
+            shutdown(fd, SHUT_RDWR);
+        }
+    }
+
+    // Sends "<command> <id> <args>" for piece idx; null if the connection
+    // has failed.
+    shared_ptr<Pending> start(const string& command, int idx, const string& args) {
+        auto p = make_shared<Pending>();
+        p->piece = idx;
+        lock_guard<mutex> lock(mtx);
+        if (broken) return nullptr;
+        p->id = next_id++;
+        string line = command + " " + to_string(p->id) + " " + args + "\n";
+        if (!send_all(fd, line.data(), line.size())) {
+            broken = true;
+            shutdown(fd, SHUT_RDWR);
+            return nullptr;
+        }
+        p->sent = chrono::steady_clock::now();
+        pending[p->id] = p;
+        return p;
+    }
+
+    // Waits for a started request. false if the seeder does not have the
+    // data, the request was cancelled, or the connection failed (see broken).
+    bool wait(const shared_ptr<Pending>& p, vector<char>& out_data) {
+        unique_lock<mutex> lock(mtx);
+        if (!cv.wait_for(lock, chrono::seconds(PEER_REQUEST_TIMEOUT_SEC), [&] { return p->done; })) {
+            // a stalled seeder: drop the connection, failing the others too
+            pending.erase(p->id);
+            if (!broken) shutdown(fd, SHUT_RDWR);
+            broken = true;
             return false;
         }
-        total_read += n;
+        if (p->ok) out_data.swap(p->data);
+        return p->ok;
     }
-    
-    close(sock_fd);
+
+    // Requests a whole piece and waits for it.
+    bool request(const string& group, const string& filename, int idx, vector<char>& out_data) {
+        shared_ptr<Pending> p = start("REQ_PIECE", idx, group + " " + filename + " " + to_string(idx));
+        return p && wait(p, out_data);
+    }
+};
+
+// Per-download pool of PeerSessions, keyed by seeder address and shared by
+// all download workers. A worker uses the least loaded connection to its
+// seeder, opening another (up to PEER_CONNS_PER_SEEDER) once each has
+// PEER_PIPELINE_DEPTH requests in flight. A seeder that closes the
+// connection without a byte in reply to REQ_PIECE is taken for a legacy one
+// and gets one-shot GET_PIECE connections (whole pieces only) for
+// PEER_LEGACY_RECHECK_SEC. A busy reply, a refused connection or a timeout
+// only count as failures (see the backoff below).
+//
+// The pool also keeps per-seeder statistics for the download: delivered
+// throughput (an EWMA over update_rates() intervals), the fastest request
+// latency seen (an RTT estimate), and consecutive failures. From these,
+// order_seeders() prefers fast seeders and passes over failing ones for
+// a backoff, and each seeder gets an in-flight limit of about twice its
+// bandwidth-delay product, which also sizes the worker pool.
+class PeerPool {
+public:
+    PeerPool() = default;
+    PeerPool(const PeerPool&) = delete;
+    PeerPool& operator=(const PeerPool&) = delete;
+    ~PeerPool() {
+        lock_guard<mutex> lock(mtx);
+        // the readers close the sockets and go away on their own
+        for (auto& entry : sessions) {
+            for (auto& session : entry.second) {
+                lock_guard<mutex> slock(session->mtx);
+                if (!session->broken) shutdown(session->fd, SHUT_RDWR);
+            }
+        }
+    }
+
+    bool fetch(const string& seeder, const string& group, const string& filename, int idx, vector<char>& out_data) {
+        note_start(seeder);
+        bool is_legacy;
+        {
+            lock_guard<mutex> lock(mtx);
+            is_legacy = is_legacy_locked(seeder);
+        }
+        if (is_legacy) return fetch_legacy(seeder, group, filename, idx, out_data);
+
+        shared_ptr<PeerSession> session = acquire(seeder);
+        if (!session) {
+            note_result(seeder, nullptr, false, 0);
+            return false;
+        }
+        shared_ptr<PeerSession::Pending> p = session->start("REQ_PIECE", idx, group + " " + filename + " " + to_string(idx));
+        if (p && session->wait(p, out_data)) {
+            note_result(seeder, p, true, out_data.size());
+            return true;
+        }
+
+        if (!check_legacy(seeder, session)) {
+            note_result(seeder, p, false, 0);
+            return false;
+        }
+        return fetch_legacy(seeder, group, filename, idx, out_data);
+    }
+
+    // Fetches piece idx (piece_len bytes) as BLOCK_SIZE blocks requested
+    // all at once and spread over seeders in proportion to their weight,
+    // so a single piece draws on every peer that has it. A failed block is
+    // asked of the next seeder once more. false if a block is still
+    // missing, or fewer than two seeders take block requests; the caller
+    // then fetches whole pieces.
+    bool fetch_blocks(const vector<string>& seeders, const string& group, const string& filename, int idx, size_t piece_len, vector<char>& out_data) {
+        vector<string> usable;
+        vector<double> weights, load;
+        {
+            lock_guard<mutex> lock(mtx);
+            double best = best_rate_locked();
+            auto now = chrono::steady_clock::now();
+            for (const auto& seeder : seeders) {
+                if (is_legacy_locked(seeder)) continue;
+                usable.push_back(seeder);
+                weights.push_back(weight_locked(seeder, best, now));
+                load.push_back(stats[seeder].in_flight);
+            }
+        }
+        if (usable.size() < 2) return false;
+
+        struct Block {
+            size_t seeder = 0;
+            shared_ptr<PeerSession> session;
+            shared_ptr<PeerSession::Pending> pending;
+        };
+        size_t num_blocks = (piece_len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        vector<Block> blocks(num_blocks);
+        auto launch = [&](size_t b, size_t seeder) {
+            size_t offset = b * BLOCK_SIZE;
+            size_t len = min(BLOCK_SIZE, piece_len - offset);
+            blocks[b].seeder = seeder;
+            note_start(usable[seeder]);
+            blocks[b].session = acquire(usable[seeder]);
+            blocks[b].pending = nullptr;
+            if (blocks[b].session) {
+                string args = group + " " + filename + " " + to_string(idx) + " " + to_string(offset) + " " + to_string(len);
+                blocks[b].pending = blocks[b].session->start("REQ_BLOCK", idx, args);
+            }
+        };
+        for (size_t b = 0; b < num_blocks; ++b) {
+            // the seeder that would finish its share soonest
+            size_t pick = 0;
+            for (size_t i = 1; i < usable.size(); ++i) {
+                if ((load[i] + 1) / weights[i] < (load[pick] + 1) / weights[pick]) pick = i;
+            }
+            load[pick]++;
+            launch(b, pick);
+        }
+
+        out_data.resize(piece_len);
+        for (size_t b = 0; b < num_blocks; ++b) {
+            size_t offset = b * BLOCK_SIZE;
+            size_t len = min(BLOCK_SIZE, piece_len - offset);
+            for (int attempt = 0;; ++attempt) {
+                Block& block = blocks[b];
+                vector<char> data;
+                bool ok = block.pending && block.session->wait(block.pending, data) && data.size() == len;
+                note_result(usable[block.seeder], block.pending, ok, data.size());
+                if (ok) {
+                    memcpy(out_data.data() + offset, data.data(), len);
+                    break;
+                }
+                if (block.session) check_legacy(usable[block.seeder], block.session);
+                // endgame: another copy of the piece already arrived
+                bool cancelled = block.pending && block.pending->cancelled;
+                if (cancelled || attempt == 1) {
+                    // the blocks still in flight are dropped when they arrive
+                    for (size_t rest = b + 1; rest < num_blocks; ++rest) note_abandoned(usable[blocks[rest].seeder]);
+                    return false;
+                }
+                launch(b, (block.seeder + 1) % usable.size());
+            }
+        }
+        return true;
+    }
+
+    // Sorts seeders into the order to try them: a weighted shuffle, so
+    // faster seeders tend to come first while slower ones still get some
+    // requests (and a chance to show they have sped up).
+    void order_seeders(vector<string>& seeders) {
+        vector<pair<double, string>> keyed;
+        {
+            lock_guard<mutex> lock(mtx);
+            double best = best_rate_locked();
+            auto now = chrono::steady_clock::now();
+            uniform_real_distribution<double> unit(0.0, 1.0);
+            for (auto& seeder : seeders) {
+                // exponential variate with rate = weight: smallest key first
+                double key = -log(1.0 - unit(thread_rng())) / weight_locked(seeder, best, now);
+                keyed.emplace_back(key, move(seeder));
+            }
+        }
+        sort(keyed.begin(), keyed.end(), [](const pair<double, string>& a, const pair<double, string>& b) {
+            return a.first < b.first;
+        });
+        for (size_t i = 0; i < keyed.size(); ++i) seeders[i] = move(keyed[i].second);
+    }
+
+    // Folds the bytes delivered over the last elapsed_sec into each
+    // seeder's throughput estimate.
+    void update_rates(double elapsed_sec) {
+        if (elapsed_sec <= 0) return;
+        lock_guard<mutex> lock(mtx);
+        for (auto& entry : stats) {
+            SeederStats& st = entry.second;
+            if (st.bytes == 0 && st.in_flight == 0) continue; // idle: keep the old estimate
+            double sample = st.bytes / elapsed_sec;
+            st.rate = st.rate == 0 ? sample : 0.75 * st.rate + 0.25 * sample;
+            st.bytes = 0;
+            // let the RTT estimate drift up so a path that got slower is
+            // not judged by one old fast sample forever
+            st.min_rtt *= 1.1;
+        }
+    }
+
+    // Concurrent fetches worth running against peers: the sum of their
+    // in-flight limits, skipping those backing off.
+    int desired_workers(const vector<string>& peers) {
+        lock_guard<mutex> lock(mtx);
+        auto now = chrono::steady_clock::now();
+        int total = 0;
+        for (const auto& peer : peers) {
+            auto it = stats.find(peer);
+            if (it == stats.end()) {
+                total += PEER_CONNS_PER_SEEDER * PEER_PIPELINE_DEPTH;
+            } else if (now >= it->second.retry_at) {
+                total += in_flight_limit(it->second);
+            }
+        }
+        return total;
+    }
+
+    // Whether a request for piece idx is already waiting on seeder.
+    bool has_pending(const string& seeder, int idx) {
+        lock_guard<mutex> lock(mtx);
+        auto it = sessions.find(seeder);
+        if (it == sessions.end()) return false;
+        for (auto& session : it->second) {
+            if (session->has_pending(idx)) return true;
+        }
+        return false;
+    }
+
+    // Cancels every outstanding request for piece idx (endgame losers).
+    void cancel_piece(int idx) {
+        lock_guard<mutex> lock(mtx);
+        for (auto& entry : sessions) {
+            for (auto& session : entry.second) session->cancel(idx);
+        }
+    }
+
+private:
+    struct SeederStats {
+        double rate = 0;        // bytes/s; 0 until measured
+        double min_rtt = 0;     // seconds, fastest request seen; 0 until measured
+        uint64_t bytes = 0;     // delivered since the last update_rates()
+        int in_flight = 0;
+        int failures = 0;       // consecutive
+        chrono::steady_clock::time_point retry_at;
+    };
+
+    // About twice the bandwidth-delay product, in requests, between one
+    // connection's pipeline and the most the pool opens for a seeder (also
+    // the limit until it has been measured). Workers hash what arrives,
+    // so a short, fast path still gets a full pipeline.
+    static int in_flight_limit(const SeederStats& st) {
+        const int most = PEER_CONNS_PER_SEEDER * PEER_PIPELINE_DEPTH;
+        if (st.rate == 0 || st.min_rtt == 0) return most;
+        int limit = (int)ceil(2 * st.rate * st.min_rtt / PIECE_SIZE) + 1;
+        return max(PEER_PIPELINE_DEPTH, min(limit, most));
+    }
+
+    // Caller holds mtx.
+    double best_rate_locked() {
+        double best = 1;
+        for (const auto& entry : stats) best = max(best, entry.second.rate);
+        return best;
+    }
+
+    // How much to favour seeder: its throughput (an unmeasured seeder is
+    // assumed as fast as the best, so it gets tried), much less once it is
+    // at its in-flight limit, next to nothing while it backs off. Caller
+    // holds mtx.
+    double weight_locked(const string& seeder, double best, chrono::steady_clock::time_point now) {
+        auto it = stats.find(seeder);
+        if (it == stats.end()) return best;
+        const SeederStats& st = it->second;
+        if (now < st.retry_at) return best * 1e-6;
+        double w = st.rate > 0 ? st.rate : best;
+        if (st.in_flight >= in_flight_limit(st)) w *= 0.05;
+        return w;
+    }
+
+    // Caller holds mtx.
+    bool is_legacy_locked(const string& seeder) {
+        auto it = legacy.find(seeder);
+        if (it == legacy.end()) return false;
+        if (chrono::steady_clock::now() < it->second) return true;
+        legacy.erase(it); // time to try REQ_PIECE again
+        return false;
+    }
+
+    // Marks seeder legacy if session failed because it refused REQ_PIECE.
+    // Takes the session lock and the pool lock one after the other, never
+    // nested (cancel_piece nests them pool first).
+    bool check_legacy(const string& seeder, const shared_ptr<PeerSession>& session) {
+        bool refused;
+        {
+            lock_guard<mutex> slock(session->mtx);
+            refused = session->refused;
+        }
+        if (!refused) return false;
+        lock_guard<mutex> lock(mtx);
+        legacy[seeder] = chrono::steady_clock::now() + chrono::seconds(PEER_LEGACY_RECHECK_SEC);
+        return true;
+    }
+
+    void note_start(const string& seeder) {
+        lock_guard<mutex> lock(mtx);
+        stats[seeder].in_flight++;
+    }
+
+    // Settles a request begun with note_start(). p is null if it never got
+    // sent. A cancelled request says nothing about the seeder.
+    void note_result(const string& seeder, const shared_ptr<PeerSession::Pending>& p, bool ok, size_t bytes) {
+        lock_guard<mutex> lock(mtx);
+        SeederStats& st = stats[seeder];
+        st.in_flight--;
+        if (ok) {
+            st.failures = 0;
+            st.bytes += bytes;
+            if (p) {
+                double rtt = chrono::duration<double>(p->arrived - p->sent).count();
+                st.min_rtt = st.min_rtt == 0 ? rtt : min(st.min_rtt, rtt);
+            }
+            return;
+        }
+        if (p && p->cancelled) return;
+        int shift = min(st.failures++, 6);
+        st.retry_at = chrono::steady_clock::now() + min(chrono::milliseconds(SEEDER_RETRY_BASE_MS << shift),
+                                                        chrono::milliseconds(SEEDER_RETRY_MAX_MS));
+    }
+
+    void note_abandoned(const string& seeder) {
+        lock_guard<mutex> lock(mtx);
+        stats[seeder].in_flight--;
+    }
+
+    bool fetch_legacy(const string& seeder, const string& group, const string& filename, int idx, vector<char>& out_data) {
+        bool ok = download_piece_from_seeder(seeder, group, filename, idx, out_data);
+        note_result(seeder, nullptr, ok, ok ? out_data.size() : 0);
+        return ok;
+    }
+
+    shared_ptr<PeerSession> acquire(const string& seeder) {
+        {
+            lock_guard<mutex> lock(mtx);
+            auto& list = sessions[seeder];
+            list.erase(remove_if(list.begin(), list.end(), [](const shared_ptr<PeerSession>& s) {
+                lock_guard<mutex> slock(s->mtx);
+                return s->broken;
+            }), list.end());
+
+            shared_ptr<PeerSession> best;
+            size_t best_load = 0;
+            for (auto& s : list) {
+                size_t load = s->in_flight();
+                if (!best || load < best_load) {
+                    best = s;
+                    best_load = load;
+                }
+            }
+            if (best && (best_load < (size_t)PEER_PIPELINE_DEPTH || list.size() >= (size_t)PEER_CONNS_PER_SEEDER)) {
+                return best;
+            }
+        }
+
+        // connect outside the pool lock so a dead seeder stalls only its own workers
+        int fd = connect_to_peer(seeder);
+        if (fd < 0) return nullptr;
+        auto session = make_shared<PeerSession>();
+        session->fd = fd;
+        thread(PeerSession::reader, session).detach();
+        lock_guard<mutex> lock(mtx);
+        sessions[seeder].push_back(session);
+        return session;
+    }
+
+    mutex mtx;
+    map<string, vector<shared_ptr<PeerSession>>> sessions;
+    map<string, chrono::steady_clock::time_point> legacy; // seeder -> recheck time
+    map<string, SeederStats> stats;
+};
+
+
+// --- Tracker Connection ---
+// A tracker socket plus the wire mode negotiated on it (see common/protocol.h).
+struct TrackerConn {
+    int fd = -1;
+    bool framed = false;
+};
+
+// cmd is one command without a trailing newline.
+bool tracker_send(TrackerConn& conn, const string& cmd) {
+    string out;
+    if (conn.framed) {
+        append_frame(out, cmd);
+    } else {
+        out = cmd + "\n";
+    }
+    return send_all(conn.fd, out.data(), out.size());
+}
+
+// Reads one complete reply. Text-mode replies are read with a single recv,
+// as before, since old trackers give no way to tell where a reply ends.
+bool tracker_recv(TrackerConn& conn, string& reply) {
+    if (conn.framed) {
+        uint32_t net_len;
+        if (!recv_all(conn.fd, (char*)&net_len, sizeof(net_len))) return false;
+        uint32_t len = ntohl(net_len);
+        if (len > MAX_MESSAGE_BYTES) return false;
+        reply.resize(len);
+        return recv_all(conn.fd, &reply[0], len);
+    }
+    char buff[8192];
+    ssize_t n = recv(conn.fd, buff, sizeof(buff), 0);
+    if (n <= 0) return false;
+    reply.assign(buff, n);
+    if (!reply.empty() && reply.back() == '\n') reply.pop_back();
     return true;
 }
 
+bool tracker_request(TrackerConn& conn, const string& cmd, string& reply) {
+    return tracker_send(conn, cmd) && tracker_recv(conn, reply);
+}
+
+void close_tracker(TrackerConn& conn) {
+    if (conn.fd != -1) close(conn.fd);
+    conn.fd = -1;
+    conn.framed = false;
+}
 
 // --- High-Level Command Implementations ---
 // ... (connect_to_tracker and do_upload are unchanged) ...
-int connect_to_tracker() {
+TrackerConn connect_to_tracker() {
     for (size_t i = 0; i < trackers.size(); ++i) {
         int idx = (current_tracker_idx.load() + i) % trackers.size();
         const auto& tracker_addr = trackers[idx];
@@ -300,14 +1486,44 @@ int connect_to_tracker() {
         if (connect(sock_fd, (sockaddr*)&addr, sizeof(addr)) == 0) {
             cout << "[CLIENT] Connected to tracker " << tracker_addr.first << ":" << tracker_addr.second << "\n";
             current_tracker_idx.store(idx);
-            return sock_fd;
+
+            // Negotiate length-prefixed framing; trackers that do not know
+            // HELLO answer "Unknown command" and we stay in text mode.
+            TrackerConn conn;
+            conn.fd = sock_fd;
+            string hello = "HELLO " + to_string(PROTOCOL_VERSION), reply;
+            if (!tracker_request(conn, hello, reply)) {
+                close(sock_fd);
+                continue;
+            }
+            conn.framed = (reply == hello);
+            return conn;
         }
         close(sock_fd);
     }
-    return -1;
+    return TrackerConn();
+}
+
+// Sends upload_file for path; the caller reads the tracker's reply.
+// Sends upload_file for a file whose hashes are known and starts seeding it.
+void send_upload(TrackerConn& conn, const string& group, const string& path, size_t file_size, const string& whole_sha, const vector<string>& piece_sha) {
+    size_t last_slash = path.find_last_of("/\\");
+    string filename = (last_slash == string::npos) ? path : path.substr(last_slash + 1);
+
+    string cmd_str = "upload_file " + group + " " + filename + " " + to_string(file_size) + " " + whole_sha + " " + to_string(piece_sha.size());
+    cmd_str.reserve(cmd_str.size() + piece_sha.size() * 41);
+    for(const auto& hash : piece_sha) {
+        cmd_str += " ";
+        cmd_str += hash;
+    }
+    tracker_send(conn, cmd_str);
+    
+    // Register file for local seeding
+    string key = group + ":" + filename;
+    set_local_file(key, {path, file_size, nullptr});
 }
 
-void do_upload(int sock, const string& group, const string& path) {
+bool do_upload(TrackerConn& conn, const string& group, const string& path) {
     size_t file_size;
     string whole_sha;
     vector<string> piece_sha;
@@ -315,96 +1531,333 @@ void do_upload(int sock, const string& group, const string& path) {
     cout << "[CLIENT] Calculating hashes for " << path << "...\n";
     if (!compute_file_hashes(path, file_size, whole_sha, piece_sha)) {
         cerr << "[CLIENT] Error: Could not process file.\n";
-        return;
+        return false;
     }
     cout << "[CLIENT] Hash calculation complete.\n";
-    
-    size_t last_slash = path.find_last_of("/\\");
-    string filename = (last_slash == string::npos) ? path : path.substr(last_slash + 1);
 
-    stringstream command;
-    command << "upload_file " << group << " " << filename << " " << file_size << " " << whole_sha << " " << piece_sha.size();
-    for(const auto& hash : piece_sha) {
-        command << " " << hash;
+    send_upload(conn, group, path, file_size, whole_sha, piece_sha);
+    return true;
+}
+
+
+// --- FIX: UPDATED do_download FUNCTION ---
+// Peers that can serve a file, from the tail of a FILEINFO reply:
+// "SEEDERS <addr>... [PARTIAL <addr> <hex bitfield>...]".
+struct SwarmView {
+    vector<string> seeders;
+    vector<pair<string, string>> partial; // addr -> packed piece bitfield
+
+    // Applies a get_swarm DELTA: new seeders are added (and leave PARTIAL,
+    // having finished), changed holders replace their old bitfield.
+    void merge(const SwarmView& delta) {
+        for (const auto& addr : delta.seeders) {
+            if (find(seeders.begin(), seeders.end(), addr) == seeders.end()) seeders.push_back(addr);
+            partial.erase(remove_if(partial.begin(), partial.end(), [&](const pair<string, string>& holder) {
+                return holder.first == addr;
+            }), partial.end());
+        }
+        for (const auto& holder : delta.partial) {
+            auto it = find_if(partial.begin(), partial.end(), [&](const pair<string, string>& h) {
+                return h.first == holder.first;
+            });
+            if (it != partial.end()) {
+                it->second = holder.second;
+            } else {
+                partial.push_back(holder);
+            }
+        }
     }
-    command << "\n";
+};
 
-    string cmd_str = command.str();
-    send(sock, cmd_str.c_str(), cmd_str.length(), 0);
-    
-    // Register file for local seeding
-    string key = group + ":" + filename;
-    {
-        lock_guard<mutex> lock(local_files_mtx);
-        local_seeding_files[key] = {path, file_size};
+static void parse_swarm(istream& ss, int num_pieces, SwarmView& view) {
+    string tag, token;
+    ss >> tag;
+    if (tag != "SEEDERS") return;
+    while (ss >> token && token != "PARTIAL") {
+        view.seeders.push_back(token);
+    }
+    string addr, hex, bits;
+    while (ss >> addr >> hex) {
+        if (hex_to_bytes(hex, bits) && bits.size() == (size_t)(num_pieces + 7) / 8) {
+            view.partial.emplace_back(addr, bits);
+        }
     }
 }
 
+// Hands out the pieces of one download rarest-first: of the pieces nobody
+// is fetching yet, one held by the fewest known peers, ties broken at random
+// so downloaders of the same file spread over it instead of all starting
+// at piece 0.
+//
+// Free pieces sit in buckets by availability (peers known to hold them),
+// each an unordered vector, so claiming a random piece from the lowest
+// non-empty bucket (swap with the last, pop) and putting one back are O(1);
+// only the handful of buckets (one per peer count) is walked. A piece that could not be fetched is held back with exponential
+// backoff before it is offered again. Workers block in next() until a piece
+// is claimable, a backoff runs out or the download is over, instead of
+// polling. Availability is recounted on every refresh of the swarm.
+//
+// Endgame: once no piece is left unclaimed, idle workers are handed pieces
+// that are already being fetched (the least duplicated first, at most
+// ENDGAME_MAX_REQUESTS requests each), so one slow seeder cannot hold up
+// the end of the download. The first copy to arrive wins; complete()
+// tells the others they lost, and the caller cancels their requests.
+//
+// The picker gives the download up when some missing piece has had no
+// holder for MAX_UNAVAILABLE_REFRESHES refreshes in a row, or when one piece
+// has failed MAX_PIECE_FAILURES times: next() then returns -1 and
+// wait_done_for() stops waiting.
+class PiecePicker {
+public:
+    explicit PiecePicker(int num_pieces)
+        : state(num_pieces, FREE), availability(num_pieces, 0), fails(num_pieces, 0),
+          requests(num_pieces, 0), buckets(1), rng(random_device{}()) {
+        for (int i = 0; i < num_pieces; ++i) insert(i);
+    }
+
+    void set_availability(const SwarmView& view) {
+        lock_guard<mutex> lock(mtx);
+        fill(availability.begin(), availability.end(), (int)view.seeders.size());
+        for (const auto& holder : view.partial) {
+            for (size_t i = 0; i < availability.size(); ++i) {
+                if (holder.second[i / 8] & (0x80 >> (i % 8))) availability[i]++;
+            }
+        }
+        for (auto& bucket : buckets) bucket.clear();
+        bool missing_unavailable = false;
+        for (size_t i = 0; i < state.size(); ++i) {
+            if (state[i] == FREE) insert(i);
+            if (state[i] != DONE && availability[i] == 0) missing_unavailable = true;
+        }
+        unavailable_refreshes = missing_unavailable ? unavailable_refreshes + 1 : 0;
+        if (unavailable_refreshes >= MAX_UNAVAILABLE_REFRESHES) {
+            give_up("no peer has had some of the missing pieces for " + to_string(unavailable_refreshes) + " refreshes");
+        }
+        cv.notify_all();
+    }
+
+    // Claims the next piece to fetch, waiting for one if need be; -1 once
+    // every piece is done or the download was given up.
+    int next() {
+        unique_lock<mutex> lock(mtx);
+        while (true) {
+            if (done == (int)state.size() || !failure.empty()) return -1;
+            promote_due();
+            int idx = take_rarest();
+            if (idx != -1) {
+                state[idx] = CLAIMED;
+                in_flight.insert(idx);
+                requests[idx] = 1;
+                return idx;
+            }
+            idx = endgame_pick();
+            if (idx != -1) {
+                requests[idx]++;
+                return idx;
+            }
+            if (backoff.empty()) {
+                cv.wait(lock);
+            } else {
+                cv.wait_until(lock, backoff.top().first);
+            }
+        }
+    }
+
+    // The claimed piece could not be fetched; once no other request for it
+    // is left, offer it again after a backoff that doubles with each failure.
+    void release(int idx) {
+        lock_guard<mutex> lock(mtx);
+        if (state[idx] != CLAIMED) return; // finished by another request
+        if (--requests[idx] > 0) {
+            cv.notify_all(); // a duplicate slot opened up
+            return;
+        }
+        in_flight.erase(idx);
+        if (fails[idx] + 1 >= MAX_PIECE_FAILURES) {
+            give_up("piece " + to_string(idx) + " failed " + to_string(fails[idx] + 1) + " times");
+            return;
+        }
+        int shift = min(fails[idx]++, 6);
+        auto delay = min(PIECE_RETRY_BASE * (1 << shift), PIECE_RETRY_MAX);
+        state[idx] = BACKOFF;
+        backoff.emplace(chrono::steady_clock::now() + delay, idx);
+        cv.notify_all(); // waiters may need an earlier deadline
+    }
+
+    // Records a verified copy of idx; false if another request got there
+    // first. Wakes the workers, which in endgame may have a piece to take.
+    bool complete(int idx) {
+        lock_guard<mutex> lock(mtx);
+        if (state[idx] == DONE) return false;
+        state[idx] = DONE;
+        in_flight.erase(idx);
+        done++;
+        cv.notify_all();
+        return true;
+    }
+
+    // Pieces neither done nor being fetched (free or backing off).
+    int unclaimed() {
+        lock_guard<mutex> lock(mtx);
+        return (int)state.size() - done - (int)in_flight.size();
+    }
+
+    bool is_done(int idx) {
+        lock_guard<mutex> lock(mtx);
+        return state[idx] == DONE;
+    }
+
+    // Waits up to timeout for the last piece; true if every piece is done
+    // or the download was given up.
+    bool wait_done_for(chrono::milliseconds timeout) {
+        unique_lock<mutex> lock(mtx);
+        return cv.wait_for(lock, timeout, [&] { return done == (int)state.size() || !failure.empty(); });
+    }
+
+    // Why the download was given up; empty if it was not.
+    string failure_reason() {
+        lock_guard<mutex> lock(mtx);
+        return failure;
+    }
+
+private:
+    enum : char { FREE, CLAIMED, BACKOFF, DONE };
+    using Clock = chrono::steady_clock;
+    static constexpr chrono::milliseconds PIECE_RETRY_BASE{100};
+    static constexpr chrono::milliseconds PIECE_RETRY_MAX{5000};
+    static constexpr int ENDGAME_MAX_REQUESTS = 3;
+    // about a minute each: retries back off up to PIECE_RETRY_MAX, and the
+    // swarm is refreshed every HAVE_ANNOUNCE_INTERVAL_MS
+    static constexpr int MAX_PIECE_FAILURES = 20;
+    static constexpr int MAX_UNAVAILABLE_REFRESHES = 60;
+
+    // Caller holds mtx for all of these.
+    void give_up(const string& reason) {
+        if (failure.empty()) failure = reason;
+        cv.notify_all();
+    }
+
+    void insert(int idx) {
+        size_t b = availability[idx];
+        if (b >= buckets.size()) buckets.resize(b + 1);
+        buckets[b].push_back(idx);
+    }
+
+    // bucket 0 holds pieces no known peer has; they wait for a refresh
+    int take_rarest() {
+        for (size_t b = 1; b < buckets.size(); ++b) {
+            if (buckets[b].empty()) continue;
+            vector<int>& bucket = buckets[b];
+            size_t pos = uniform_int_distribution<size_t>(0, bucket.size() - 1)(rng);
+            int idx = bucket[pos];
+            bucket[pos] = bucket.back();
+            bucket.pop_back();
+            return idx;
+        }
+        return -1;
+    }
+
+    // Only called with no free piece left; in_flight holds at most one
+    // piece per worker.
+    int endgame_pick() {
+        int best = -1;
+        for (int idx : in_flight) {
+            // no more requests than peers holding it: each goes to another seeder
+            int limit = min(ENDGAME_MAX_REQUESTS, availability[idx]);
+            if (requests[idx] < limit && (best == -1 || requests[idx] < requests[best])) best = idx;
+        }
+        return best;
+    }
+
+    void promote_due() {
+        auto now = Clock::now();
+        while (!backoff.empty() && backoff.top().first <= now) {
+            int idx = backoff.top().second;
+            backoff.pop();
+            if (state[idx] == BACKOFF) {
+                state[idx] = FREE;
+                insert(idx);
+            }
+        }
+    }
+
+    mutex mtx;
+    condition_variable cv;
+    vector<char> state;
+    vector<int> availability;
+    vector<int> fails;
+    vector<int> requests;              // outstanding requests per claimed piece
+    set<int> in_flight;                // claimed, not done
+    vector<vector<int>> buckets;       // free pieces by availability
+    priority_queue<pair<Clock::time_point, int>, vector<pair<Clock::time_point, int>>, greater<>> backoff;
+    int done = 0;
+    int unavailable_refreshes = 0;     // in a row with a missing piece nobody has
+    string failure;                    // set once the download is given up
+    mt19937 rng;
+};
 
-// --- FIX: UPDATED do_download FUNCTION ---
 void do_download(const string& group, const string& filename, const string& dest_path) {
     thread([=]() {
         // Step 1: Create a new connection for this download task.
-        int tracker_sock = connect_to_tracker();
-        if (tracker_sock == -1) {
+        TrackerConn tracker = connect_to_tracker();
+        if (tracker.fd == -1) {
             cerr << "[DOWNLOAD] Failed to connect to tracker for download task.\n";
             return;
         }
 
-        // Step 2: Read stored credentials and log in on the new connection.
-        string user, pass;
+        // Step 2: Attach the new connection to our login. The session
+        // token skips the password check and the login broadcast; a tracker
+        // that does not know the token gets a full login instead.
+        string user, pass, token;
         int port;
         {
             lock_guard<mutex> lock(g_credentials_mtx);
             user = g_currentUser;
             pass = g_currentPassword;
+            token = g_session_token;
             port = g_peer_port;
         }
 
         if (user.empty()) {
             cout << "[DOWNLOAD] Error: Login required.\n";
-            close(tracker_sock);
+            close_tracker(tracker);
             return;
         }
 
-        string login_cmd = "login " + user + " " + pass + " " + to_string(port) + "\n";
-        send(tracker_sock, login_cmd.c_str(), login_cmd.length(), 0);
-        char login_buff[1024];
-        ssize_t n_login = recv(tracker_sock, login_buff, sizeof(login_buff) - 1, 0);
-        if (n_login <= 0) {
-            cerr << "[DOWNLOAD] Login failed for background task.\n";
-            close(tracker_sock);
-            return;
-        }
-        login_buff[n_login] = '\0';
-        if (string(login_buff).find("successful") == string::npos) {
-            cerr << "[DOWNLOAD] Login failed for background task: " << login_buff;
-            close(tracker_sock);
-            return;
+        string login_reply;
+        bool resumed = !token.empty() && tracker_request(tracker, "resume " + token, login_reply)
+                       && login_reply.rfind("Ok resumed", 0) == 0;
+        if (!resumed) {
+            string login_cmd = "login " + user + " " + pass + " " + to_string(port);
+            if (!tracker_request(tracker, login_cmd, login_reply)) {
+                cerr << "[DOWNLOAD] Login failed for background task.\n";
+                close_tracker(tracker);
+                return;
+            }
+            if (login_reply.find("successful") == string::npos) {
+                cerr << "[DOWNLOAD] Login failed for background task: " << login_reply << "\n";
+                close_tracker(tracker);
+                return;
+            }
         }
         
-        // Step 3: Now that we are logged in, get the file info.
-        string get_cmd = "get_file " + group + " " + filename + "\n";
-        send(tracker_sock, get_cmd.c_str(), get_cmd.length(), 0);
-        char buff[8192];
-        ssize_t n = recv(tracker_sock, buff, sizeof(buff) - 1, 0);
-        
-        string logout_cmd = "logout\n";
-        send(tracker_sock, logout_cmd.c_str(), logout_cmd.length(), 0);
-        close(tracker_sock);
-
-        if (n <= 0) {
+        // Step 3: Now that we are logged in, get the file info. The
+        // connection stays open for the whole download: it announces our
+        // pieces (have_pieces) and refreshes the list of peers to fetch from.
+        string get_cmd = "get_file " + group + " " + filename;
+        string response;
+        if (!tracker_request(tracker, get_cmd, response)) {
             cerr << "[DOWNLOAD] Failed to get file info from tracker.\n";
+            close_tracker(tracker);
             return;
         }
-        buff[n] = '\0';
-        
-        string response(buff);
+
         stringstream ss(response);
         string command;
         ss >> command;
         if (command != "FILEINFO") {
-            cerr << "[DOWNLOAD] Error: " << response;
+            cerr << "[DOWNLOAD] Error: " << response << "\n";
+            close_tracker(tracker);
             return;
         }
 
@@ -416,17 +1869,12 @@ void do_download(const string& group, const string& filename, const string& dest
         vector<string> piece_hashes(num_pieces);
         for (int i = 0; i < num_pieces; ++i) ss >> piece_hashes[i];
 
-        string seeders_tag;
-        ss >> seeders_tag;
-        vector<string> seeders;
-        if (seeders_tag == "SEEDERS") {
-            string seeder_addr;
-            while (ss >> seeder_addr) {
-                seeders.push_back(seeder_addr);
-            }
-        }
-        if (seeders.empty()) {
+        mutex swarm_mtx;
+        SwarmView swarm;
+        parse_swarm(ss, num_pieces, swarm);
+        if (swarm.seeders.empty() && swarm.partial.empty()) {
             cerr << "[DOWNLOAD] No seeders available for this file.\n";
+            close_tracker(tracker);
             return;
         }
 
@@ -436,11 +1884,13 @@ void do_download(const string& group, const string& filename, const string& dest
         int out_fd = open(part_path.c_str(), O_RDWR | O_CREAT, 0644);
         if (out_fd < 0) {
             perror("open part file");
+            close_tracker(tracker);
             return;
         }
         if (ftruncate(out_fd, file_size) < 0) {
             perror("ftruncate part file");
             close(out_fd);
+            close_tracker(tracker);
             return;
         }
 
@@ -450,80 +1900,213 @@ void do_download(const string& group, const string& filename, const string& dest
             ongoing_downloads.emplace(piecewise_construct, make_tuple(dl_key), make_tuple(group, filename, num_pieces));
         }
 
-        vector<atomic<int>> piece_status(num_pieces);
+        // verified pieces are served to other downloaders straight from the .part file
+        auto have = make_shared<PieceBitfield>(num_pieces);
+        set_local_file(dl_key, {part_path, file_size, have});
+
+        RunningFileHash file_hash(out_fd, file_size, have);
+        PeerPool pool;
+        PiecePicker picker(num_pieces);
+        picker.set_availability(swarm);
         atomic<int> completed_count(0);
 
+        // Verifies a fetched copy of piece_idx and writes it to the .part
+        // file. true once the piece is in, from this copy or (endgame)
+        // from another request that won.
+        auto store_piece = [&](int piece_idx, const vector<char>& piece_data) {
+            if (sha1_hex_of_buffer(piece_data.data(), piece_data.size()) != piece_hashes[piece_idx]) return false;
+            off_t offset = (off_t)piece_idx * PIECE_SIZE;
+            // a duplicate write of the same verified bytes is harmless
+            if (pwrite(out_fd, piece_data.data(), piece_data.size(), offset) != (ssize_t)piece_data.size()) return false;
+            if (picker.complete(piece_idx)) {
+                pool.cancel_piece(piece_idx);
+                have->set(piece_idx);
+                file_hash.piece_done(piece_idx, piece_data);
+                completed_count++;
+                lock_guard<mutex> lock(downloads_mtx);
+                ongoing_downloads.at(dl_key).completed_pieces++;
+            }
+            return true;
+        };
+
+        // The refresh loop below resizes the pool. Surplus workers park
+        // between pieces until it grows again, so a thread is only started
+        // to go past the largest size so far. All under pool_mtx.
+        mutex pool_mtx;
+        condition_variable pool_cv;
+        int target_workers = 1, running_workers = 0, parked_workers = 0;
+        int resumes = 0;           // parked workers told to run again
+        bool pool_closed = false;  // download over, parked workers exit
         auto worker_lambda = [&]() {
-            while (completed_count.load() < num_pieces) {
-                int piece_idx = -1;
-                for (int i = 0; i < num_pieces; ++i) {
-                    int expected = 0;
-                    if (piece_status[i].compare_exchange_strong(expected, 1)) {
-                        piece_idx = i;
-                        break;
+            int piece_idx;
+            while (true) {
+                {
+                    unique_lock<mutex> lock(pool_mtx);
+                    if (running_workers > target_workers) {
+                        running_workers--;
+                        parked_workers++;
+                        pool_cv.wait(lock, [&] { return pool_closed || resumes > 0; });
+                        if (pool_closed) return;
+                        resumes--;
                     }
                 }
-
-                if (piece_idx == -1) {
-                    this_thread::sleep_for(chrono::milliseconds(100));
-                    continue;
-                }
-
-                bool piece_ok = false;
-                vector<string> shuffled_seeders = seeders;
-                random_device rd;
-                mt19937 g(rd());
-                shuffle(shuffled_seeders.begin(), shuffled_seeders.end(), g);
-
-                for (const auto& seeder : shuffled_seeders) {
-                    vector<char> piece_data;
-                    if (download_piece_from_seeder(seeder, group, filename, piece_idx, piece_data)) {
-                        if (sha1_hex_of_buffer(piece_data.data(), piece_data.size()) == piece_hashes[piece_idx]) {
-                            off_t offset = (off_t)piece_idx * PIECE_SIZE;
-                            if (pwrite(out_fd, piece_data.data(), piece_data.size(), offset) == (ssize_t)piece_data.size()) {
-                                piece_status[piece_idx] = 2;
-                                completed_count++;
-                                {
-                                    lock_guard<mutex> lock(downloads_mtx);
-                                    ongoing_downloads.at(dl_key).completed_pieces++;
-                                }
-                                piece_ok = true;
-                                break;
-                            }
+                if ((piece_idx = picker.next()) == -1) break;
+
+                // full seeders plus the partial seeders that have this piece
+                vector<string> candidates;
+                {
+                    lock_guard<mutex> lock(swarm_mtx);
+                    candidates = swarm.seeders;
+                    for (const auto& holder : swarm.partial) {
+                        if (holder.second[piece_idx / 8] & (0x80 >> (piece_idx % 8))) {
+                            candidates.push_back(holder.first);
                         }
                     }
                 }
+                pool.order_seeders(candidates);
+                // endgame: leave seeders already asked for this piece to the
+                // other request
+                if (candidates.size() > 1) {
+                    candidates.erase(remove_if(candidates.begin(), candidates.end(), [&](const string& seeder) {
+                        return pool.has_pending(seeder, piece_idx);
+                    }), candidates.end());
+                }
 
-                if (!piece_ok) {
-                    piece_status[piece_idx] = 0;
+                // Whole pieces from one holder each keep every holder busy
+                // while there are more pieces left than holders. Past that
+                // (a file with few pieces, the tail, endgame) the holders
+                // share the piece block by block instead. A bad striped
+                // copy cannot be pinned on one of them, so it is fetched
+                // whole from each in turn below.
+                size_t piece_len = min(PIECE_SIZE, file_size - (size_t)piece_idx * PIECE_SIZE);
+                vector<char> piece_data;
+                bool stripe = candidates.size() > 1 && picker.unclaimed() < (int)candidates.size();
+                bool piece_ok = stripe
+                                && pool.fetch_blocks(candidates, group, filename, piece_idx, piece_len, piece_data)
+                                && store_piece(piece_idx, piece_data);
+                for (const auto& seeder : candidates) {
+                    // endgame: stop once another copy won
+                    if (piece_ok || picker.is_done(piece_idx)) break;
+                    piece_ok = pool.fetch(seeder, group, filename, piece_idx, piece_data) && store_piece(piece_idx, piece_data);
                 }
+
+                // nobody (reachable) had it; it comes back after a backoff
+                if (!piece_ok) picker.release(piece_idx);
             }
+            lock_guard<mutex> lock(pool_mtx);
+            running_workers--;
         };
-        
-        unsigned num_workers = min((unsigned)seeders.size(), (unsigned)max(4, (int)thread::hardware_concurrency()));
-        num_workers = min(num_workers, (unsigned)num_pieces);
+
+        // Each worker keeps about one piece in flight on the shared
+        // sessions, so the pool follows what the peers can take: their
+        // in-flight limits, as measured so far.
         vector<thread> workers;
-        for (unsigned i = 0; i < num_workers; ++i) {
-            workers.emplace_back(worker_lambda);
+        auto resize_workers = [&]() {
+            vector<string> peers;
+            {
+                lock_guard<mutex> lock(swarm_mtx);
+                peers = swarm.seeders;
+                for (const auto& holder : swarm.partial) peers.push_back(holder.first);
+            }
+            int remaining = num_pieces - completed_count.load();
+            int want = min({pool.desired_workers(peers), MAX_DOWNLOAD_WORKERS, remaining});
+            lock_guard<mutex> lock(pool_mtx);
+            target_workers = max(1, want);
+            int wake = min(parked_workers, target_workers - running_workers);
+            if (wake > 0) {
+                parked_workers -= wake;
+                running_workers += wake;
+                resumes += wake;
+                pool_cv.notify_all();
+            }
+            while (running_workers < target_workers) {
+                running_workers++;
+                workers.emplace_back(worker_lambda);
+            }
+        };
+        resize_workers();
+
+        // Announce new pieces, pick up newly joined peers, and resize the
+        // worker pool once per interval until every piece is in or the
+        // picker gives the download up.
+        int announced = 0;
+        string swarm_version; // from the last get_swarm reply
+        int since_full = 0;
+        auto last_refresh = chrono::steady_clock::now();
+        while (!picker.wait_done_for(chrono::milliseconds(HAVE_ANNOUNCE_INTERVAL_MS))) {
+            auto now = chrono::steady_clock::now();
+            pool.update_rates(chrono::duration<double>(now - last_refresh).count());
+            last_refresh = now;
+            int done = completed_count.load();
+            string reply;
+            if (done != announced) {
+                announced = done;
+                string bits = have->copy();
+                string have_hex = bytes_to_hex((const unsigned char*)bits.data(), bits.size());
+                tracker_request(tracker, "have_pieces " + group + " " + filename + " " + have_hex, reply);
+            }
+            string swarm_cmd = "get_swarm " + group + " " + filename;
+            if (++since_full >= SWARM_FULL_REFRESH_INTERVALS) {
+                since_full = 0;
+            } else if (!swarm_version.empty()) {
+                swarm_cmd += " " + swarm_version;
+            }
+            if (tracker_request(tracker, swarm_cmd, reply)) {
+                stringstream fresh(reply);
+                string tag, kind;
+                fresh >> tag >> swarm_version >> kind;
+                if (tag == "SWARM") {
+                    SwarmView updated;
+                    parse_swarm(fresh, num_pieces, updated);
+                    lock_guard<mutex> lock(swarm_mtx);
+                    if (kind == "FULL") {
+                        swarm = move(updated);
+                    } else {
+                        swarm.merge(updated);
+                    }
+                    picker.set_availability(swarm);
+                } else {
+                    swarm_version.clear();
+                }
+            }
+            resize_workers();
+        }
+        {
+            lock_guard<mutex> lock(pool_mtx);
+            pool_closed = true;
         }
+        pool_cv.notify_all();
         for (auto& t : workers) {
             t.join();
         }
 
+        // stop serving the .part file; it is renamed or deleted below
+        erase_local_file(dl_key);
+        // on failure, also withdraw the PARTIAL entry the tracker hands out
+        // for it, so other downloaders stop asking this client for pieces
+        auto abandon = [&] {
+            string reply;
+            tracker_request(tracker, "stop_share " + group + " " + filename, reply);
+            close_tracker(tracker);
+        };
+
         if (completed_count.load() != num_pieces) {
-            cerr << "\n[DOWNLOAD] Download failed for " << filename << ". Could not retrieve all pieces.\n";
+            string reason = picker.failure_reason();
+            cerr << "\n[DOWNLOAD] Download failed for " << filename << ". Could not retrieve all pieces"
+                 << (reason.empty() ? string(".") : " (" + reason + ").") << "\n";
             close(out_fd);
             unlink(part_path.c_str());
+            abandon();
             return;
         }
         
-        string final_hash;
-        size_t final_size;
-        vector<string> ignored_pieces;
-        if (!compute_file_hashes(part_path, final_size, final_hash, ignored_pieces) || final_hash != whole_sha) {
+        // every piece was checked on arrival and the whole-file digest kept
+        // up as they landed, so there is no second pass over the file
+        if (file_hash.finish() != whole_sha) {
              cerr << "\n[DOWNLOAD] Final hash verification failed for " << filename << ". Deleting corrupt file.\n";
              close(out_fd);
              unlink(part_path.c_str());
+             abandon();
              return;
         }
 
@@ -531,6 +2114,7 @@ void do_download(const string& group, const string& filename, const string& dest
         if (rename(part_path.c_str(), dest_path.c_str()) != 0) {
             perror("rename failed");
             unlink(part_path.c_str());
+            abandon();
             return;
         }
 
@@ -540,24 +2124,16 @@ void do_download(const string& group, const string& filename, const string& dest
             ongoing_downloads.at(dl_key).is_complete = true;
         }
         
-        string key = group + ":" + filename;
-        {
-            lock_guard<mutex> lock(local_files_mtx);
-            local_seeding_files[key] = {dest_path, file_size};
-        }
+        set_local_file(dl_key, {dest_path, file_size, nullptr});
         
-        int final_tracker_sock = connect_to_tracker();
-        if(final_tracker_sock != -1) {
-            string final_login_cmd = "login " + user + " " + pass + " " + to_string(port) + "\n";
-            send(final_tracker_sock, final_login_cmd.c_str(), final_login_cmd.length(), 0);
-            char final_login_buff[1024];
-            recv(final_tracker_sock, final_login_buff, sizeof(final_login_buff) - 1, 0);
-            
-            do_upload(final_tracker_sock, group, dest_path);
-            
-            send(final_tracker_sock, logout_cmd.c_str(), logout_cmd.length(), 0);
-            close(final_tracker_sock);
-        }
+        // become a full seeder on the same (still logged in) connection;
+        // closing it leaves the main login alone, so there is no logout.
+        // The hashes are the verified ones from the tracker, so the file
+        // is not read again for them.
+        string upload_reply;
+        send_upload(tracker, group, dest_path, file_size, whole_sha, piece_hashes);
+        tracker_recv(tracker, upload_reply);
+        close_tracker(tracker);
     }).detach();
 }
 
@@ -578,6 +2154,22 @@ void do_show_downloads() {
     }
 }
 
+// Tells the tracker this client is still up, so it keeps handing out our
+// address to downloaders. Only sent while logged in; a broken connection is
+// left for the command loop to notice and replace.
+void heartbeat_thread(TrackerConn* conn) {
+    while (true) {
+        this_thread::sleep_for(chrono::seconds(HEARTBEAT_INTERVAL_SEC));
+        {
+            lock_guard<mutex> lock(g_credentials_mtx);
+            if (g_currentUser.empty()) continue;
+        }
+        lock_guard<mutex> lock(g_main_conn_mtx);
+        string reply;
+        if (conn->fd != -1) tracker_request(*conn, "heartbeat", reply);
+    }
+}
+
 // --- Main Program Logic ---
 int main(int argc, char* argv[]) {
     if (argc < 3) {
@@ -605,6 +2197,9 @@ int main(int argc, char* argv[]) {
         cerr << "[CLIENT] No valid trackers found in file.\n";
         return 1;
     }
+    // Start at a random tracker so clients spread across all of them;
+    // connect_to_tracker() fails over to the next one in the list.
+    current_tracker_idx.store(random_device{}() % trackers.size());
     
     // --- FIX: STORE PEER PORT GLOBALLY ---
     string ip_port(argv[2]);
@@ -616,13 +2211,27 @@ if (colon_pos == string::npos) {
 string peer_ip = ip_port.substr(0, colon_pos);
 g_peer_port = stoi(ip_port.substr(colon_pos + 1));
 
+    // optional peer server tuning after the two positional arguments
+    for (int i = 3; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg.rfind("--upload-slots=", 0) == 0) {
+            g_upload_slots = max(1, atoi(arg.c_str() + 15));
+        } else if (arg.rfind("--upload-workers=", 0) == 0) {
+            g_upload_workers = max(1, atoi(arg.c_str() + 17));
+        } else {
+            cerr << "Usage: ./p2p_client <tracker_info_file> <peer_ip:peer_port> [--upload-slots=N] [--upload-workers=N]\n";
+            return 1;
+        }
+    }
+
     thread(peer_listener_thread, g_peer_port).detach();
 
-    int sock = connect_to_tracker();
-    if (sock == -1) {
+    TrackerConn sock = connect_to_tracker();
+    if (sock.fd == -1) {
         cerr << "[CLIENT] Failed to connect to any tracker.\n";
         return 1;
     }
+    thread(heartbeat_thread, &sock).detach();
 
     string current_pass_temp; // Temporary storage for password
 
@@ -633,6 +2242,7 @@ g_peer_port = stoi(ip_port.substr(colon_pos + 1));
         if (line_str.empty()) continue;
         add_history(line_str.c_str());
         if (line_str == "quit" || line_str == "exit") break;
+        unique_lock<mutex> conn_lock(g_main_conn_mtx);
         
         stringstream ss(line_str);
         string command;
@@ -643,8 +2253,8 @@ g_peer_port = stoi(ip_port.substr(colon_pos + 1));
             ss >> group >> path;
             if (group.empty() || path.empty()) {
                 cout << "Usage: upload_file <group_id> <file_path>\n";
-            } else {
-                do_upload(sock, group, path);
+            } else if (!do_upload(sock, group, path)) {
+                continue;
             }
         } else if (command == "download_file") {
             string group, filename, dest_path;
@@ -670,38 +2280,66 @@ g_peer_port = stoi(ip_port.substr(colon_pos + 1));
                 lock_guard<mutex> lock(g_credentials_mtx);
                 g_currentUser.clear();
                 g_currentPassword.clear();
+                g_session_token.clear();
             }
-            line_str += "\n";
-            send(sock, line_str.c_str(), line_str.length(), 0);
+            tracker_send(sock, line_str);
         }
 
-        char resp_buff[8192];
-        ssize_t n = recv(sock, resp_buff, sizeof(resp_buff) - 1, 0);
-        if (n <= 0) {
+        string resp;
+        if (!tracker_recv(sock, resp)) {
             cout << "[CLIENT] Connection to tracker lost. Attempting to reconnect...\n";
-            close(sock);
+            close_tracker(sock);
             sock = connect_to_tracker();
-            if (sock == -1) {
+            if (sock.fd == -1) {
                 cerr << "[CLIENT] Reconnect failed. Exiting.\n";
                 break;
             }
+            // carry the login over to the new tracker and re-announce our address
+            string token;
+            {
+                lock_guard<mutex> lock(g_credentials_mtx);
+                token = g_session_token;
+            }
+            string resume_reply;
+            if (!token.empty() && tracker_request(sock, "resume " + token + " " + to_string(g_peer_port), resume_reply)) {
+                cout << "[SERVER] " << resume_reply << "\n";
+            }
             continue;
         }
-        resp_buff[n] = '\0';
-        cout << "[SERVER] " << resp_buff;
+
+        // the session token is kept for background connections, not shown
+        string token;
+        size_t token_pos = resp.find(" TOKEN ");
+        if (command == "login" && token_pos != string::npos) {
+            token = resp.substr(token_pos + 7);
+            resp.erase(token_pos);
+        }
+        cout << "[SERVER] " << resp << "\n";
+
+        // stop serving the pieces ourselves too
+        if (command == "stop_share" && resp.rfind("Stopped sharing", 0) == 0) {
+            string cmd_word, group, filename;
+            stringstream share_ss(line_str);
+            share_ss >> cmd_word >> group >> filename;
+            erase_local_file(group + ":" + filename);
+        }
 
         // --- FIX: STORE CREDENTIALS ON SUCCESSFUL LOGIN ---
-        if (command == "login" && string(resp_buff).find("successful") != string::npos) {
+        if (command == "login" && resp.find("successful") != string::npos) {
             stringstream user_ss(line_str);
             string temp_cmd, user_str;
             user_ss >> temp_cmd >> user_str;
             lock_guard<mutex> lock(g_credentials_mtx);
             g_currentUser = user_str;
             g_currentPassword = current_pass_temp;
+            g_session_token = token;
         }
     }
 
-    if (sock != -1) close(sock);
+    {
+        lock_guard<mutex> lock(g_main_conn_mtx);
+        close_tracker(sock);
+    }
     cout << "[CLIENT] Exiting.\n";
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,147 @@
+#ifndef POLLER_H
+#define POLLER_H
+
+// Thin readiness-notification wrapper: epoll on Linux, kqueue on macOS/BSD.
+// Every registration is one-shot: once an event has been delivered for a fd
+// it stays disarmed until rearm() is called, so only one thread ever services
+// a given connection at a time.
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <cerrno>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#endif
+
+struct PollEvent
+{
+    void* data;
+    bool readable;
+    bool writable;
+    bool hangup;
+};
+
+inline bool set_nonblocking(int fd)
+{
+    int flags=fcntl(fd,F_GETFL,0);
+    if(flags<0)
+    return false;
+    return fcntl(fd,F_SETFL,flags|O_NONBLOCK)==0;
+}
+
+class Poller
+{
+public:
+    Poller()
+    {
+#ifdef __linux__
+        poll_fd=epoll_create1(0);
+#else
+        poll_fd=kqueue();
+#endif
+    }
+
+    ~Poller()
+    {
+        if(poll_fd>=0)
+        close(poll_fd);
+    }
+
+    Poller(const Poller&)=delete;
+    Poller& operator=(const Poller&)=delete;
+
+    bool ok() const { return poll_fd>=0; }
+
+    // want_write selects writability instead of readability as the interest.
+    bool add(int fd,void* data,bool want_write=false)
+    {
+        return arm(fd,data,want_write,true);
+    }
+
+    bool rearm(int fd,void* data,bool want_write)
+    {
+        return arm(fd,data,want_write,false);
+    }
+
+    void remove(int fd)
+    {
+#ifdef __linux__
+        epoll_ctl(poll_fd,EPOLL_CTL_DEL,fd,nullptr);
+#else
+        struct kevent changes[2];
+        EV_SET(&changes[0],fd,EVFILT_READ,EV_DELETE,0,0,nullptr);
+        EV_SET(&changes[1],fd,EVFILT_WRITE,EV_DELETE,0,0,nullptr);
+        // one of the two filters is usually not registered; ignore ENOENT
+        kevent(poll_fd,&changes[0],1,nullptr,0,nullptr);
+        kevent(poll_fd,&changes[1],1,nullptr,0,nullptr);
+#endif
+    }
+
+    // Returns the number of events stored in out, 0 on timeout, -1 on error.
+    int wait(PollEvent* out,int max_events,int timeout_ms)
+    {
+        if(max_events>MAX_BATCH)
+        max_events=MAX_BATCH;
+#ifdef __linux__
+        epoll_event evs[MAX_BATCH];
+        int n=epoll_wait(poll_fd,evs,max_events,timeout_ms);
+        if(n<0)
+        return errno==EINTR ? 0 : -1;
+        for(int i=0;i<n;i++)
+        {
+            out[i].data=evs[i].data.ptr;
+            out[i].readable=(evs[i].events & EPOLLIN)!=0;
+            out[i].writable=(evs[i].events & EPOLLOUT)!=0;
+            out[i].hangup=(evs[i].events & (EPOLLHUP|EPOLLERR|EPOLLRDHUP))!=0;
+        }
+        return n;
+#else
+        struct kevent evs[MAX_BATCH];
+        timespec ts;
+        timespec* pts=nullptr;
+        if(timeout_ms>=0)
+        {
+            ts.tv_sec=timeout_ms/1000;
+            ts.tv_nsec=(long)(timeout_ms%1000)*1000000L;
+            pts=&ts;
+        }
+        int n=kevent(poll_fd,nullptr,0,evs,max_events,pts);
+        if(n<0)
+        return errno==EINTR ? 0 : -1;
+        for(int i=0;i<n;i++)
+        {
+            out[i].data=evs[i].udata;
+            out[i].readable=evs[i].filter==EVFILT_READ;
+            out[i].writable=evs[i].filter==EVFILT_WRITE;
+            out[i].hangup=(evs[i].flags & (EV_EOF|EV_ERROR))!=0;
+        }
+        return n;
+#endif
+    }
+
+private:
+    static const int MAX_BATCH=256;
+    int poll_fd=-1;
+
+    bool arm(int fd,void* data,bool want_write,bool first)
+    {
+#ifdef __linux__
+        epoll_event ev{};
+        ev.events=(want_write ? EPOLLOUT : EPOLLIN)|EPOLLRDHUP|EPOLLONESHOT;
+        ev.data.ptr=data;
+        return epoll_ctl(poll_fd,first ? EPOLL_CTL_ADD : EPOLL_CTL_MOD,fd,&ev)==0;
+#else
+        (void)first;
+        struct kevent ev;
+        EV_SET(&ev,fd,want_write ? EVFILT_WRITE : EVFILT_READ,EV_ADD|EV_ONESHOT,0,0,data);
+        return kevent(poll_fd,&ev,1,nullptr,0,nullptr)==0;
+#endif
+    }
+};
+
+#endif
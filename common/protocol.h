@@ -0,0 +1,90 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+// Client <-> tracker wire format, shared by the tracker and the client.
+//
+// A connection starts in the original text mode: one command per '\n'
+// terminated line and one '\n' terminated reply per command. A client that
+// sends "HELLO <version>\n" and receives "HELLO <version>\n" back switches
+// that connection to framed mode, where every message in either direction
+// is a 4-byte big-endian payload length followed by the payload. Trackers
+// that predate framing answer HELLO with "Unknown command", so new clients
+// simply stay in text mode with them.
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <arpa/inet.h>
+
+using namespace std;
+
+static const int PROTOCOL_VERSION = 2;
+static const size_t FRAME_HEADER_BYTES = 4;
+// Upper bound for one message in either mode; larger input is a broken peer.
+static const uint32_t MAX_MESSAGE_BYTES = 64u * 1024 * 1024;
+
+enum ExtractStatus { EXTRACT_NEED_MORE, EXTRACT_OK, EXTRACT_ERROR };
+
+inline void append_frame(string& out, string_view payload)
+{
+    uint32_t net_len = htonl((uint32_t)payload.size());
+    out.append((const char*)&net_len, FRAME_HEADER_BYTES);
+    out.append(payload.data(), payload.size());
+}
+
+// Pulls the next complete message starting at buf[pos]. On EXTRACT_OK, msg
+// points into buf and pos is advanced past the message; the caller erases
+// the consumed prefix once it has drained everything.
+inline ExtractStatus extract_message(const string& buf, size_t& pos, bool framed, string_view& msg)
+{
+    if (framed) {
+        if (buf.size() - pos < FRAME_HEADER_BYTES) return EXTRACT_NEED_MORE;
+        uint32_t net_len;
+        memcpy(&net_len, buf.data() + pos, FRAME_HEADER_BYTES);
+        uint32_t len = ntohl(net_len);
+        if (len > MAX_MESSAGE_BYTES) return EXTRACT_ERROR;
+        if (buf.size() - pos - FRAME_HEADER_BYTES < len) return EXTRACT_NEED_MORE;
+        msg = string_view(buf.data() + pos + FRAME_HEADER_BYTES, len);
+        pos += FRAME_HEADER_BYTES + len;
+        return EXTRACT_OK;
+    }
+
+    size_t nl = buf.find('\n', pos);
+    if (nl == string::npos) {
+        return buf.size() - pos > MAX_MESSAGE_BYTES ? EXTRACT_ERROR : EXTRACT_NEED_MORE;
+    }
+    size_t end = nl;
+    if (end > pos && buf[end - 1] == '\r') --end;
+    msg = string_view(buf.data() + pos, end - pos);
+    pos = nl + 1;
+    return EXTRACT_OK;
+}
+
+// Whitespace tokenizer; the views point into line.
+inline void split_tokens(string_view line, vector<string_view>& out)
+{
+    out.clear();
+    size_t i = 0, n = line.size();
+    while (i < n) {
+        while (i < n && (line[i] == ' ' || line[i] == '\t' || line[i] == '\r' || line[i] == '\n')) ++i;
+        size_t start = i;
+        while (i < n && line[i] != ' ' && line[i] != '\t' && line[i] != '\r' && line[i] != '\n') ++i;
+        if (i > start) out.push_back(line.substr(start, i - start));
+    }
+}
+
+inline bool parse_number(string_view s, uint64_t& out)
+{
+    if (s.empty() || s.size() > 20) return false;
+    uint64_t v = 0;
+    for (char c : s) {
+        if (c < '0' || c > '9') return false;
+        v = v * 10 + (uint64_t)(c - '0');
+    }
+    out = v;
+    return true;
+}
+
+#endif
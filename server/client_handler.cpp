@@ -1,249 +1,453 @@
 // client_handler.cpp
+#include <algorithm>
 #include <cstddef>
 #include <string>
 #include <sys/socket.h>
 #include <unistd.h>
-#include <sstream>
+#include <cerrno>
+#include <iostream>
 #include "sync.h"
 #include <arpa/inet.h>
 #include <vector>
 #include "client_handler.h"
 #include "details.h"
+#include "liveness.h"
+#include "metrics.h"
+#include "persist.h"
+#include "../common/protocol.h"
 using namespace std;
 
 // NOTE: sync_mutex is defined/used in sync.cpp; don't redefine here.
 // pthread_mutex_t sync_mutex=PTHREAD_MUTEX_INITIALIZER;   
 
-void* client_handler(void* arg)
+// Replicates a mutation made for session. Its reply may only go out once
+// the mutation is durable: thread-per-client sessions wait here, reactor
+// sessions record the LSN and the reactor holds the reply until then.
+static void sync_mutation(ClientSession& session, const string& msg)
 {
-    int socket_fd = *(int*)arg;
-    delete (int*)arg;
+    uint64_t lsn = send_sync(msg, !session.defer_durable);
+    session.reply_lsn = max(session.reply_lsn, lsn);
+}
 
-    sockaddr_in client_addr;
-    socklen_t len = sizeof(client_addr);
-    if (getpeername(socket_fd, (struct sockaddr*)&client_addr, &len) < 0) {
-        perror("getpeername");
-    }
-    string client_ip = inet_ntoa(client_addr.sin_addr);
+string handle_client_request(ClientSession& session, string_view request)
+{
+    string& current_user = session.current_user;
+    const string& client_ip = session.client_ip;
 
-    char buff[4096];
-    string current_user;
+    vector<string_view>& tokens = session.tokens;
+    split_tokens(request, tokens);
+    // missing arguments read as empty strings, like a short stringstream read
+    auto arg = [&](size_t i) { return i < tokens.size() ? string(tokens[i]) : string(); };
 
-    while (1)
-    {
-        ssize_t r = recv(socket_fd, buff, sizeof(buff) - 1, 0);
-        if (r <= 0)
-        {
-            // client disconnected or error
-            if (r < 0) perror("recv");
-            break;
-        }
-        buff[r] = '\0';
-        string client_request(buff);
+    string command = arg(0);
+    string response = "Unknown command";
 
-        // remove trailing newline if present
-        if (!client_request.empty() && client_request.back() == '\n') {
-            client_request.pop_back();
+    if (command == "HELLO")
+    {
+        // framing handshake; the caller switches modes after this reply is sent
+        uint64_t version = 0;
+        if (tokens.size() > 1 && parse_number(tokens[1], version) && version >= (uint64_t)PROTOCOL_VERSION) {
+            response = "HELLO " + to_string(PROTOCOL_VERSION);
+            session.switch_to_framed = true;
         }
+    }
+    else if (command == "create_user")
+    {
+        string userName = arg(1), password = arg(2);
+        response = create_user(userName, password);
 
-        // use client_request for parsing (not raw buff)
-        stringstream ss(client_request);
-        string command;
-        ss >> command;
-        string response = "Unknown command";
-
-        if (command == "create_user")
-        {
-            string userName, password;
-            ss >> userName >> password;
-            response = create_user(userName, password);
+        // sync to peer trackers
+        string peerSync = "SYNC|create_user|" + userName + "|" + password + "|";
+        sync_mutation(session, peerSync);
+    }
+    else if (command == "login")
+    {
+        string userName = arg(1), password = arg(2), listen_port_str = arg(3);
+        string client_listen_addr = client_ip + ":" + listen_port_str;
+        response = login(userName, password, client_listen_addr);
+        if (response.find("successful") != string::npos || response.find("Ok logged in") != string::npos) {
+            current_user = userName;
+            session.listen_addr = client_listen_addr;
+            session.resumed = false;
+            // login() already set the address; setting it again together
+            // with the TTL restores it if an expiry sweep ran in between
+            refresh_client(userName, client_listen_addr);
+            // the token lets later connections skip the password (resume)
+            string token = session_token_for(userName);
+            response += " TOKEN " + token;
 
-            // sync to peer trackers
-            string peerSync = "SYNC|create_user|" + userName + "|" + password + "|";
-            send_sync(peerSync);
+            // sync login to other trackers (so they know client address and token)
+            string peerSync = "SYNC|login|" + userName + "|" + client_listen_addr + "|" + token + "|";
+            sync_mutation(session, peerSync);
         }
-        else if (command == "login")
-        {
-            string userName, password, listen_port_str;
-            ss >> userName >> password >> listen_port_str;
-            string client_listen_addr = client_ip + ":" + listen_port_str;
-            response = login(userName, password, client_listen_addr);
-            if (response.find("successful") != string::npos || response.find("Ok logged in") != string::npos) {
-                current_user = userName;
+    }
+    else if (command == "resume")
+    {
+        // resume <token> [listen_port]: attaches this connection to an
+        // existing login. With a port the listen address is (re)announced,
+        // e.g. after failing over to another tracker; without one it is a
+        // background connection that leaves the address alone.
+        string user = user_for_token(arg(1));
+        if (user.empty()) {
+            response = "Invalid session token";
+        } else {
+            current_user = user;
+            session.resumed = true;
+            session.listen_addr.clear();
+            if (tokens.size() > 2) {
+                session.listen_addr = client_ip + ":" + arg(2);
+                refresh_client(user, session.listen_addr);
+                sync_mutation(session, "SYNC|login|" + user + "|" + session.listen_addr + "|" + arg(1) + "|");
             }
-
-            // sync login to other trackers (so they know client address)
-            string peerSync = "SYNC|login|" + userName + "|" + client_listen_addr + "|";
-            send_sync(peerSync);
+            response = "Ok resumed " + user;
         }
-        else if (command == "create_group")
+    }
+    else if (command == "create_group")
+    {
+        string groupId = arg(1);
+        if (current_user.empty())
         {
-            string groupId;
-            ss >> groupId;
-            if (current_user.empty())
-            {
-                response = "Login required";
-            }
-            else
-            {
-                response = create_group(groupId, current_user);
-                string peerSync = "SYNC|create_group|" + groupId + "|" + current_user + "|";
-                send_sync(peerSync);
-            }
+            response = "Login required";
         }
-        else if (command == "join_group")
+        else
         {
-            string groupId;
-            ss >> groupId;
-            if (current_user.empty())
-            {
-                response = "Login required";
-            }
-            else
-            {
-                response = join_group(groupId, current_user);
-                string peerSync = "SYNC|join_group|" + groupId + "|" + current_user + "|";
-                send_sync(peerSync);
-            }
+            response = create_group(groupId, current_user);
+            string peerSync = "SYNC|create_group|" + groupId + "|" + current_user + "|";
+            sync_mutation(session, peerSync);
         }
-        else if (command == "list_groups")
+    }
+    else if (command == "join_group")
+    {
+        string groupId = arg(1);
+        if (current_user.empty())
         {
-            response = list_groups();
+            response = "Login required";
         }
-        else if (command == "list_requests")
+        else
         {
-            string groupId;
-            ss >> groupId;
-            // list_requests requires owner authorization
-            response = list_requests(groupId, current_user);
+            response = join_group(groupId, current_user);
+            string peerSync = "SYNC|join_group|" + groupId + "|" + current_user + "|";
+            sync_mutation(session, peerSync);
+        }
+    }
+    else if (command == "list_groups")
+    {
+        response = list_groups();
+    }
+    else if (command == "list_requests")
+    {
+        string groupId = arg(1);
+        // list_requests requires owner authorization
+        response = list_requests(groupId, current_user);
+    }
+    else if (command == "accept_request")
+    {
+        string groupId = arg(1), userId = arg(2);
+        response = accept_request(groupId, userId, current_user);
+        if (response.find("accepted") != string::npos || response.find("OK") != string::npos) {
+            string peerSync = "SYNC|accept_request|" + groupId + "|" + userId + "|";
+            sync_mutation(session, peerSync);
         }
-        else if (command == "accept_request")
+    }
+    else if (command == "leave_group")
+    {
+        string groupId = arg(1);
+        if (current_user.empty())
         {
-            string groupId, userId;
-            ss >> groupId >> userId;
-            response = accept_request(groupId, userId, current_user);
-            if (response.find("accepted") != string::npos || response.find("OK") != string::npos) {
-                string peerSync = "SYNC|accept_request|" + groupId + "|" + userId + "|";
-                send_sync(peerSync);
-            }
+            response = "Login required";
         }
-        else if (command == "leave_group")
+        else
         {
-            string groupId;
-            ss >> groupId;
-            if (current_user.empty())
-            {
-                response = "Login required";
-            }
-            else
-            {
-                response = leave_group(groupId, current_user);
-                string peerSync = "SYNC|leave_group|" + groupId + "|" + current_user + "|";
-                send_sync(peerSync);
-            }
+            response = leave_group(groupId, current_user);
+            string peerSync = "SYNC|leave_group|" + groupId + "|" + current_user + "|";
+            sync_mutation(session, peerSync);
         }
-        else if (command == "logout")
+    }
+    else if (command == "logout")
+    {
+        if (!current_user.empty())
         {
-            if (!current_user.empty())
-            {
-                response = logout(current_user);
-                // sync logout
-                string peerSync = "SYNC|logout|" + current_user + "|";
-                send_sync(peerSync);
-
-                current_user.clear();
-            }
-            else {
-                response = "Not logged in";
+            response = logout(current_user);
+            forget_client(current_user);
+            revoke_session_token(current_user);
+            // sync logout; "revoke" ends the session token everywhere
+            string peerSync = "SYNC|logout|" + current_user + "|revoke|";
+            sync_mutation(session, peerSync);
+
+            current_user.clear();
+        }
+        else {
+            response = "Not logged in";
+        }
+    }
+    else if (command == "heartbeat")
+    {
+        // keeps the logged-in user's listen address from expiring, and puts
+        // it back if it already had; address and TTL are refreshed together
+        // so a concurrent expiry sweep cannot drop the address again
+        if (current_user.empty()) {
+            response = "Login required";
+        } else {
+            if (!session.listen_addr.empty()) {
+                refresh_client(current_user, session.listen_addr);
+                sync_mutation(session, "SYNC|heartbeat|" + current_user + "|" + session.listen_addr + "|");
             }
+            response = "OK heartbeat";
         }
-        else if (command == "upload_file")
-        {
-            // require login to upload
-            if (current_user.empty()) {
-                response = "Login required";
-            } else {
-                string group_id, filename, whole_sha1;
-                size_t file_size;
-                int num_pieces;
-                ss >> group_id >> filename >> file_size >> whole_sha1 >> num_pieces;
-
-                vector<string> piece_hashes;
-                if (num_pieces > 0) {
-                    piece_hashes.resize(num_pieces);
-                    for (int i = 0; i < num_pieces; ++i) {
-                        ss >> piece_hashes[i];
-                    }
-                }
+    }
+    else if (command == "upload_file")
+    {
+        // require login to upload
+        if (current_user.empty()) {
+            response = "Login required";
+        } else {
+            string group_id = arg(1), filename = arg(2), whole_sha1 = arg(4);
+            uint64_t file_size = 0, num_pieces = 0;
+            if (tokens.size() < 6 || !parse_number(tokens[3], file_size) || !parse_number(tokens[5], num_pieces)
+                || num_pieces > tokens.size() - 6) {
+                return "Usage: upload_file <group_id> <file_name> <file_size> <sha1> <num_pieces> <piece_sha1>...";
+            }
 
-                response = upload_file(group_id, filename, file_size, whole_sha1, piece_hashes, current_user);
-
-                // build sync message containing piece hashes and seeders (seeder ids)
-                string key = make_file_key(group_id, filename);
-                // it's possible fileDetails[key] now exists
-                FileInfo info;
-                bool haveInfo = false;
-                {
-                    // access protected map (but upload_file already locked/unlocked)
-                    // we still check presence without locking long-term
-                    pthread_mutex_lock(&state_mutex);
-                    if (fileDetails.count(key)) {
-                        info = fileDetails[key];
-                        haveInfo = true;
-                    }
-                    pthread_mutex_unlock(&state_mutex);
+            // piece hashes arrive as hex and are stored packed
+            string piece_digests;
+            piece_digests.reserve(num_pieces * DIGEST_BYTES);
+            for (size_t i = 0; i < num_pieces; ++i) {
+                if (!append_digest_from_hex(piece_digests, tokens[6 + i])) {
+                    return "Upload_failed : malformed piece hash";
                 }
+            }
+
+            response = upload_file(group_id, filename, file_size, whole_sha1, piece_digests, current_user);
+
+            // build sync message containing piece hashes and seeders (seeder ids)
+            string key = make_file_key(group_id, filename);
+            // it's possible fileDetails[key] now exists
+            FileInfo info;
+            bool haveInfo = copy_file_info(key, info);
 
-                if (haveInfo) {
-                    string peerSync = "SYNC|upload_file|" + group_id + "|" + filename + "|" + to_string(info.file_size) + "|" + info.whole_file_sha1 + "|";
-                    // piece hashes
-                    for (const auto &ph : info.piece_hashes) {
-                        peerSync += ph + "|";
-                    }
-                    // seeders (ids)
-                    peerSync += "SEEDERS|";
-                    for (const auto &seeder : info.seeders) {
-                        // store seeder id (username). receiver can map to client_addresses if known.
-                        peerSync += seeder + "|";
-                    }
-                    send_sync(peerSync);
+            if (haveInfo) {
+                string peerSync = "SYNC|upload_file|" + group_id + "|" + filename + "|" + to_string(info.file_size) + "|" + info.whole_file_sha1 + "|" + to_string(info.num_pieces()) + "|";
+                // piece hashes, hex encoded on the text sync channel
+                append_digests_hex(peerSync, info.piece_digests, '|');
+                // seeders (ids)
+                peerSync += "SEEDERS|";
+                for (const auto &seeder : info.seeders) {
+                    // store seeder id (username). receiver can map to client_addresses if known.
+                    peerSync += seeder + "|";
                 }
+                sync_mutation(session, peerSync);
             }
         }
-        else if (command == "list_files")
-        {
-            string groupId;
-            ss >> groupId;
-            response = list_files(groupId, current_user);
+    }
+    else if (command == "sync_stats")
+    {
+        // admin view of the outbound replication log
+        SyncQueueStats st = get_sync_queue_stats();
+        response = "sync_queue_depth " + to_string(st.depth) + "\n"
+                 + "sync_queue_bytes " + to_string(st.bytes) + "\n"
+                 + "sync_queue_oldest_age_us " + to_string(st.oldest_age_us) + "\n"
+                 + "sync_log_entries " + to_string(st.log_entries) + "\n"
+                 + "sync_log_bytes " + to_string(st.log_bytes) + "\n"
+                 + "sync_last_seq " + to_string(st.last_seq) + "\n"
+                 + "sync_peers " + to_string(st.peers) + "\n"
+                 + "sync_peers_connected " + to_string(st.peers_connected) + "\n"
+                 + "sync_enqueued_total " + to_string(st.enqueued) + "\n"
+                 + "sync_sent_total " + to_string(st.sent) + "\n"
+                 + "sync_evicted_total " + to_string(st.evicted) + "\n"
+                 + "sync_resumes_total " + to_string(st.resumes) + "\n"
+                 + "sync_full_syncs_total " + to_string(st.full_syncs) + "\n"
+                 + "sync_batches_total " + to_string(st.batches) + "\n"
+                 + "sync_last_batch_msgs " + to_string(st.last_batch_msgs) + "\n"
+                 + "sync_replication_lag_us " + to_string(st.last_lag_us) + "\n"
+                 + "sync_backpressure_waits_total " + to_string(st.backpressure_waits);
+    }
+    else if (command == "stats")
+    {
+        // admin view of every metric, same text as the --stats-port endpoint
+        response = tracker_stats();
+        if (!response.empty() && response.back() == '\n') response.pop_back();
+    }
+    else if (command == "list_files")
+    {
+        string groupId = arg(1);
+        response = list_files(groupId, current_user);
+    }
+    else if (command == "get_file")
+    {
+        string groupId = arg(1), filename = arg(2);
+        response = get_file(groupId, filename, current_user);
+    }
+    else if (command == "get_swarm")
+    {
+        // get_swarm <group_id> <file_name> [<version>]: a downloader's
+        // periodic peer refresh, without the fixed FILEINFO part
+        string groupId = arg(1), filename = arg(2);
+        response = get_swarm(groupId, filename, current_user, arg(3));
+    }
+    else if (command == "have_pieces")
+    {
+        // have_pieces <group_id> <file_name> <hex bitfield>: a downloader
+        // announcing the pieces it has verified so far
+        string groupId = arg(1), filename = arg(2), bits;
+        if (current_user.empty()) {
+            response = "Login required";
+        } else if (!append_bytes_from_hex(bits, tokens.size() > 3 ? tokens[3] : string_view())) {
+            response = "Usage: have_pieces <group_id> <file_name> <hex_bitfield>";
+        } else {
+            response = have_pieces(groupId, filename, current_user, bits);
+            if (response == "Pieces updated") {
+                sync_mutation(session, "SYNC|have_pieces|" + groupId + "|" + filename + "|" + current_user + "|" + arg(3) + "|");
+            }
         }
-        else if (command == "get_file")
-        {
-            string groupId, filename;
-            ss >> groupId >> filename;
-            response = get_file(groupId, filename, current_user);
+    }
+    else if (command == "stop_share")
+    {
+        string groupId = arg(1), filename = arg(2);
+        response = stop_share(groupId, filename, current_user);
+        // optionally sync stop_share
+        string peerSync = "SYNC|stop_share|" + groupId + "|" + filename + "|" + current_user + "|";
+        sync_mutation(session, peerSync);
+    }
+
+    return response;
+}
+
+bool process_client_input(ClientSession& session, string& inbuf, string& outbuf)
+{
+    size_t pos = 0;
+    string_view request;
+    bool ok = true;
+    while (1) {
+        ExtractStatus st = extract_message(inbuf, pos, session.framed, request);
+        if (st == EXTRACT_NEED_MORE) break;
+        if (st == EXTRACT_ERROR) {
+            cerr << "[TRACKER] malformed or oversized request from " << session.client_ip << "\n";
+            record_malformed_request();
+            ok = false;
+            break;
         }
-        else if (command == "stop_share")
-        {
-            string groupId, filename;
-            ss >> groupId >> filename;
-            response = stop_share(groupId, filename, current_user);
-            // optionally sync stop_share
-            string peerSync = "SYNC|stop_sharing|" + groupId + "|" + filename + "|" + current_user + "|";
-            send_sync(peerSync);
+        if (request.empty()) continue;
+
+        uint64_t start = metrics_now_ns();
+        string response = handle_client_request(session, request);
+        string_view command = request.substr(0, request.find(' '));
+        record_command(command_metric_index(command), metrics_now_ns() - start);
+        if (session.framed) {
+            append_frame(outbuf, response);
+        } else {
+            outbuf += response;
+            outbuf += "\n";
         }
+        if (session.switch_to_framed) {
+            session.switch_to_framed = false;
+            session.framed = true;
+        }
+    }
+    inbuf.erase(0, pos);
+    return ok;
+}
+
+string tracker_stats()
+{
+    string out;
+    render_metrics(out);
+
+    SyncQueueStats sync = get_sync_queue_stats();
+    append_gauge(out, "tracker_sync_queue_depth", sync.depth);
+    append_gauge(out, "tracker_sync_queue_bytes", sync.bytes);
+    append_gauge(out, "tracker_sync_queue_oldest_age_us", sync.oldest_age_us);
+    append_gauge(out, "tracker_sync_log_entries", sync.log_entries);
+    append_gauge(out, "tracker_sync_replication_lag_us", sync.last_lag_us);
+    append_gauge(out, "tracker_sync_peers_connected", sync.peers_connected);
+    append_counter(out, "tracker_sync_sent_total", sync.sent);
+    append_counter(out, "tracker_sync_backpressure_waits_total", sync.backpressure_waits);
 
-        response += "\n";
-        send(socket_fd, response.c_str(), response.size(), 0);
+    LivenessStats live = get_liveness_stats();
+    append_gauge(out, "tracker_clients_tracked", live.tracked);
+    append_counter(out, "tracker_clients_expired_total", live.expired);
+
+    PersistStats wal = get_persist_stats();
+    append_gauge(out, "tracker_wal_last_lsn", wal.last_lsn);
+    append_gauge(out, "tracker_wal_durable_lsn", wal.durable_lsn);
+    append_counter(out, "tracker_wal_fsyncs_total", wal.fsyncs);
+    append_counter(out, "tracker_wal_write_failures_total", wal.write_failures);
+    return out;
+}
+
+void end_client_session(ClientSession& session)
+{
+    // on disconnect, if user logged in, remove entry (logout). Resumed
+    // connections belong to a login made elsewhere and leave it alone;
+    // their address, if any, ages out through the heartbeat TTL.
+    if (!session.current_user.empty() && !session.resumed) {
+        logout(session.current_user);
+        forget_client(session.current_user);
+        string peerSync = "SYNC|logout|" + session.current_user + "|";
+        // nobody is waiting for a reply
+        send_sync(peerSync, false);
+    }
+    session.current_user.clear();
+}
+
+static bool send_all(int socket_fd, const char* data, size_t len)
+{
+    size_t sent = 0;
+    while (sent < len) {
+        ssize_t n = send(socket_fd, data + sent, len - sent, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        sent += n;
+    }
+    return true;
+}
+
+string peer_ip_of(int socket_fd)
+{
+    sockaddr_in client_addr;
+    socklen_t len = sizeof(client_addr);
+    if (getpeername(socket_fd, (struct sockaddr*)&client_addr, &len) < 0) {
+        perror("getpeername");
+        return "";
     }
+    char ip[INET_ADDRSTRLEN];
+    if (!inet_ntop(AF_INET, &client_addr.sin_addr, ip, sizeof(ip))) {
+        return "";
+    }
+    return ip;
+}
+
+// Thread-per-client mode: one detached thread blocks in recv for the whole session.
+void* client_handler(void* arg)
+{
+    int socket_fd = *(int*)arg;
+    delete (int*)arg;
+
+    ClientSession session;
+    session.fd = socket_fd;
+    session.client_ip = peer_ip_of(socket_fd);
+    session_opened();
+
+    char buff[16384];
+    string inbuf, outbuf;
+
+    while (1)
+    {
+        ssize_t r = recv(socket_fd, buff, sizeof(buff), 0);
+        if (r <= 0)
+        {
+            // client disconnected or error
+            if (r < 0) perror("recv");
+            break;
+        }
+        inbuf.append(buff, r);
 
-    // on disconnect, if user logged in, remove entry (logout)
-    if (!current_user.empty()) {
-        logout(current_user);
-        string peerSync = "SYNC|logout|" + current_user + "|";
-        send_sync(peerSync);
-        current_user.clear();
+        bool ok = process_client_input(session, inbuf, outbuf);
+        if (!send_all(socket_fd, outbuf.data(), outbuf.size()) || !ok) break;
+        outbuf.clear();
     }
 
+    end_client_session(session);
+    session_closed();
     close(socket_fd);
     return nullptr;
 }
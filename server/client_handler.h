@@ -6,12 +6,44 @@
 #include<string>
 #include<sys/socket.h>
 #include<unistd.h>
-#include<sstream>
+#include<string_view>
+#include<vector>
 
 #include "details.h"
 using namespace std;
 
 
+// Per-connection state shared by the thread-per-client and reactor modes.
+struct ClientSession {
+    int fd = -1;
+    string client_ip;
+    string current_user;
+    string listen_addr; // ip:port the user's peer listener announced at login
+    bool resumed = false; // attached with a session token instead of login
+    // length-prefixed framing negotiated with HELLO (see common/protocol.h)
+    bool framed = false;
+    bool switch_to_framed = false;
+    // Set by the reactor: send_sync does not wait for the WAL, and
+    // reply_lsn is the newest record the buffered replies depend on.
+    bool defer_durable = false;
+    uint64_t reply_lsn = 0;
+    // scratch space reused across requests
+    vector<string_view> tokens;
+};
+
+// Runs one command against the tracker state and returns the reply text
+// (without framing). Safe to call from any thread for distinct sessions.
+string handle_client_request(ClientSession& session, string_view request);
+// Handles every complete message buffered in inbuf, appending the encoded
+// replies to outbuf. Returns false if the input is malformed.
+bool process_client_input(ClientSession& session, string& inbuf, string& outbuf);
+// Every tracker metric (metrics.h plus replication and WAL gauges) in the
+// Prometheus text format; served by the stats command and --stats-port.
+string tracker_stats();
+// Logs out the session's user, if any, when its connection goes away.
+void end_client_session(ClientSession& session);
+string peer_ip_of(int socket_fd);
+
 void* client_handler(void* arg);
 
 #endif
\ No newline at end of file
@@ -1,54 +1,333 @@
 // details.cpp
 #include "details.h"
 #include <pthread.h>
+#include <random>
 #include <sstream>
 
 map<string,string> userDetails;
 map<string,Group> groupDetails;
 map<string, FileInfo> fileDetails;
+map<string, set<string>> groupFiles;
 map<string,string> client_addresses;
+map<string,string> session_tokens;
+map<string,string> token_users;
 
-pthread_mutex_t state_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_rwlock_t users_lock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_rwlock_t groups_lock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_rwlock_t files_lock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_rwlock_t addrs_lock = PTHREAD_RWLOCK_INITIALIZER;
+thread_local bool holding_all_state_locks = false;
 
 string make_file_key(const string& group_id, const string& filename)
 {
     return group_id + ":" + filename;
 }
 
+// Clock for FileInfo swarm versions, advanced under files_lock (exclusive).
+// Versions go out as "<epoch>-<n>": the epoch is random per process, so a
+// version from another tracker (after failover) or an earlier run is never
+// taken for one of ours.
+static atomic<uint64_t> swarm_clock(0);
+static const string swarm_epoch = to_string(random_device{}());
+
+static void note_swarm_change(FileInfo& info, const string& userId)
+{
+    info.swarm_changed[userId] = ++swarm_clock;
+}
+
+static void note_swarm_removal(FileInfo& info, const string& userId)
+{
+    info.swarm_changed.erase(userId);
+    info.swarm_removed = ++swarm_clock;
+}
+
+// 0 if the version is missing or not from this process.
+static uint64_t parse_swarm_version(const string& version)
+{
+    size_t dash = version.find('-');
+    if (dash == string::npos || version.compare(0, dash, swarm_epoch) != 0)
+    {
+        return 0;
+    }
+    return strtoull(version.c_str() + dash + 1, nullptr, 10);
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+bool append_digest_from_hex(string& out, string_view hex)
+{
+    if (hex.size() != DIGEST_HEX_CHARS)
+    {
+        return false;
+    }
+    char digest[DIGEST_BYTES];
+    for (size_t i = 0; i < DIGEST_BYTES; ++i)
+    {
+        int hi = hex_value(hex[2 * i]), lo = hex_value(hex[2 * i + 1]);
+        if (hi < 0 || lo < 0)
+        {
+            return false;
+        }
+        digest[i] = (char)((hi << 4) | lo);
+    }
+    out.append(digest, DIGEST_BYTES);
+    return true;
+}
+
+void append_digests_hex(string& out, const string& digests, char separator)
+{
+    static const char hex[] = "0123456789abcdef";
+    size_t start = out.size();
+    size_t n = digests.size() / DIGEST_BYTES;
+    out.resize(start + n * (DIGEST_HEX_CHARS + 1));
+    char* p = &out[start];
+    for (size_t i = 0; i < digests.size(); ++i)
+    {
+        unsigned char b = (unsigned char)digests[i];
+        *p++ = hex[b >> 4];
+        *p++ = hex[b & 0xF];
+        if (i % DIGEST_BYTES == DIGEST_BYTES - 1) *p++ = separator;
+    }
+}
+
+bool append_bytes_from_hex(string& out, string_view hex)
+{
+    if (hex.size() % 2 != 0)
+    {
+        return false;
+    }
+    size_t start = out.size();
+    out.resize(start + hex.size() / 2);
+    for (size_t i = 0; i < hex.size() / 2; ++i)
+    {
+        int hi = hex_value(hex[2 * i]), lo = hex_value(hex[2 * i + 1]);
+        if (hi < 0 || lo < 0)
+        {
+            out.resize(start);
+            return false;
+        }
+        out[start + i] = (char)((hi << 4) | lo);
+    }
+    return true;
+}
+
+void append_hex(string& out, const string& bytes)
+{
+    static const char hex[] = "0123456789abcdef";
+    for (unsigned char b : bytes)
+    {
+        out += hex[b >> 4];
+        out += hex[b & 0xF];
+    }
+}
+
+// caller must hold groups_lock (shared or exclusive)
+static bool is_member(const string& group_id, const string& userId)
+{
+    auto it = groupDetails.find(group_id);
+    return it != groupDetails.end() && it->second.members.count(userId);
+}
+
+string group_owner(const string& groupId)
+{
+    ReadLock lock(&groups_lock);
+    auto it = groupDetails.find(groupId);
+    return it == groupDetails.end() ? "" : it->second.owner;
+}
+
+void set_client_address(const string& username, const string& client_addr)
+{
+    WriteLock lock(&addrs_lock);
+    client_addresses[username] = client_addr;
+}
+
+bool copy_file_info(const string& key, FileInfo& out)
+{
+    ReadLock lock(&files_lock);
+    auto it = fileDetails.find(key);
+    if (it == fileDetails.end())
+    {
+        return false;
+    }
+    // Field by field: a plain copy would read fileinfo_prefix non-atomically
+    // while get_file may be publishing it under the same shared lock. The
+    // copy does not need the cache, so it is left empty.
+    const FileInfo& info = it->second;
+    out.group_id = info.group_id;
+    out.owner_id = info.owner_id;
+    out.filename = info.filename;
+    out.whole_file_sha1 = info.whole_file_sha1;
+    out.piece_digests = info.piece_digests;
+    out.file_size = info.file_size;
+    out.seeders = info.seeders;
+    out.partial = info.partial;
+    out.fileinfo_prefix.reset();
+    out.swarm_changed = info.swarm_changed;
+    out.swarm_removed = info.swarm_removed;
+    return true;
+}
+
+void restore_group(const string& groupId, const string& owner, const vector<string>& members, const vector<string>& pending)
+{
+    WriteLock lock(&groups_lock);
+    auto it = groupDetails.find(groupId);
+    if (it == groupDetails.end())
+    {
+        it = groupDetails.emplace(groupId, Group()).first;
+        it->second.owner = owner;
+    }
+    it->second.members.insert(members.begin(), members.end());
+    for (const auto& p : pending)
+    {
+        if (!it->second.members.count(p))
+        {
+            it->second.pendRequests.insert(p);
+        }
+    }
+}
+
+void replace_state(const function<void()>& rebuild)
+{
+    WriteLock glock(&groups_lock);
+    WriteLock flock(&files_lock);
+    WriteLock alock(&addrs_lock);
+    // nothing else holds users_lock together with another lock, so taking
+    // it last here cannot deadlock
+    WriteLock ulock(&users_lock);
+    userDetails.clear();
+    groupDetails.clear();
+    fileDetails.clear();
+    groupFiles.clear();
+    client_addresses.clear();
+    session_tokens.clear();
+    token_users.clear();
+
+    holding_all_state_locks = true;
+    rebuild();
+    holding_all_state_locks = false;
+}
+
+void restore_file(const string& group_id, const string& filename, size_t file_size, const string& whole_sha1, const string& piece_digests, const string& owner_id, const vector<string>& seeders, const vector<pair<string, string>>& partial)
+{
+    WriteLock lock(&files_lock);
+    string key = make_file_key(group_id, filename);
+    auto it = fileDetails.find(key);
+    if (it == fileDetails.end())
+    {
+        FileInfo info;
+        info.group_id = group_id;
+        info.owner_id = owner_id;
+        info.filename = filename;
+        info.file_size = file_size;
+        info.whole_file_sha1 = whole_sha1;
+        info.piece_digests = piece_digests;
+        info.swarm_removed = ++swarm_clock;
+        it = fileDetails.emplace(key, move(info)).first;
+        groupFiles[group_id].insert(filename);
+    }
+    for (const auto& seeder : seeders)
+    {
+        if (it->second.seeders.insert(seeder).second)
+        {
+            note_swarm_change(it->second, seeder);
+        }
+    }
+    for (const auto& holder : partial)
+    {
+        if (!it->second.seeders.count(holder.first))
+        {
+            it->second.partial[holder.first] = holder.second;
+            note_swarm_change(it->second, holder.first);
+        }
+    }
+}
+
 string create_user(const string& username, const string& password)
 {
-    pthread_mutex_lock(&state_mutex);
+    WriteLock lock(&users_lock);
     if (userDetails.find(username) != userDetails.end())
     {
-        pthread_mutex_unlock(&state_mutex);
         return "User already exists try logging in";
     }
     userDetails[username] = password;
-    pthread_mutex_unlock(&state_mutex);
     return "User with " + username + " created";
 }
 
 // NOTE: updated login signature to accept client_addr (IP:PORT)
 string login(const string& username, const string& password, const string& client_addr)
 {
-    pthread_mutex_lock(&state_mutex);
-    auto it = userDetails.find(username);
-    if (it == userDetails.end())
     {
-        pthread_mutex_unlock(&state_mutex);
-        return "User not found";
-    }
-    if (it->second != password)
-    {
-        pthread_mutex_unlock(&state_mutex);
-        return "Wrong password";
+        ReadLock lock(&users_lock);
+        auto it = userDetails.find(username);
+        if (it == userDetails.end())
+        {
+            return "User not found";
+        }
+        if (it->second != password)
+        {
+            return "Wrong password";
+        }
     }
     // store client's public address for seeder discovery
-    client_addresses[username] = client_addr;
-    pthread_mutex_unlock(&state_mutex);
+    set_client_address(username, client_addr);
     return "Ok logged in successful";
 }
 
+string session_token_for(const string& username)
+{
+    {
+        ReadLock lock(&users_lock);
+        auto it = session_tokens.find(username);
+        if (it != session_tokens.end()) return it->second;
+    }
+    // 128 random bits, hex encoded
+    random_device rd;
+    string bytes;
+    for (int i = 0; i < 4; ++i) {
+        uint32_t r = rd();
+        bytes.append((const char*)&r, sizeof(r));
+    }
+    string token;
+    append_hex(token, bytes);
+
+    WriteLock lock(&users_lock);
+    // a concurrent login may have issued one first
+    auto inserted = session_tokens.emplace(username, token);
+    if (inserted.second) token_users[token] = username;
+    return inserted.first->second;
+}
+
+void set_session_token(const string& username, const string& token)
+{
+    WriteLock lock(&users_lock);
+    auto it = session_tokens.find(username);
+    if (it != session_tokens.end()) token_users.erase(it->second);
+    session_tokens[username] = token;
+    token_users[token] = username;
+}
+
+string user_for_token(const string& token)
+{
+    ReadLock lock(&users_lock);
+    auto it = token_users.find(token);
+    return it == token_users.end() ? "" : it->second;
+}
+
+void revoke_session_token(const string& username)
+{
+    WriteLock lock(&users_lock);
+    auto it = session_tokens.find(username);
+    if (it == session_tokens.end()) return;
+    token_users.erase(it->second);
+    session_tokens.erase(it);
+}
+
 // Overload/backwards-compat: keep two-arg login if some code calls it
 string login(const string& username, const string& password)
 {
@@ -58,46 +337,40 @@ string login(const string& username, const string& password)
 
 string create_group(const string& groupId, const string& userId)
 {
-    pthread_mutex_lock(&state_mutex);
+    WriteLock lock(&groups_lock);
     if (groupDetails.find(groupId) != groupDetails.end())
     {
-        pthread_mutex_unlock(&state_mutex);
         return "Group already exists";
     }
     Group g;
     g.owner = userId;
     g.members.insert(userId);
     groupDetails[groupId] = g;
-    pthread_mutex_unlock(&state_mutex);
     return "Group " + groupId + " created";
 }
 
 string join_group(const string& groupId, const string& userId)
 {
-    pthread_mutex_lock(&state_mutex);
+    WriteLock lock(&groups_lock);
     auto it = groupDetails.find(groupId);
     if (it == groupDetails.end())
     {
-        pthread_mutex_unlock(&state_mutex);
         return "group with " + groupId + " is not found";
     }
     // if already member, return message
     if (it->second.members.count(userId)) {
-        pthread_mutex_unlock(&state_mutex);
         return "Already a member";
     }
     it->second.pendRequests.insert(userId);
-    pthread_mutex_unlock(&state_mutex);
     return "Join request submitted";
 }
 
 string leave_group(const string& groupId, const string& userId)
 {
-    pthread_mutex_lock(&state_mutex);
+    WriteLock lock(&groups_lock);
     auto it = groupDetails.find(groupId);
     if (it == groupDetails.end())
     {
-        pthread_mutex_unlock(&state_mutex);
         return "group not found";
     }
     it->second.members.erase(userId);
@@ -109,23 +382,22 @@ string leave_group(const string& groupId, const string& userId)
         }
         else {
             groupDetails.erase(it);
-            pthread_mutex_unlock(&state_mutex);
             return "user left and group removed";
         }
     }
-    pthread_mutex_unlock(&state_mutex);
     return "user " + userId + " left group";
 }
 
 string list_groups()
 {
-    pthread_mutex_lock(&state_mutex);
     stringstream ss;
-    for (const auto &it : groupDetails)
     {
-        ss << it.first << "\n";
+        ReadLock lock(&groups_lock);
+        for (const auto &it : groupDetails)
+        {
+            ss << it.first << "\n";
+        }
     }
-    pthread_mutex_unlock(&state_mutex);
     string out = ss.str();
     if (out.empty())
     {
@@ -137,26 +409,25 @@ string list_groups()
 // list_requests requires owner authorization; updated signature to include ownerId
 string list_requests(const string& groupId, const string& ownerId)
 {
-    pthread_mutex_lock(&state_mutex);
-    auto it = groupDetails.find(groupId);
-
-    if (it == groupDetails.end())
-    {
-        pthread_mutex_unlock(&state_mutex);
-        return "group not found";
-    }
-    if (it->second.owner != ownerId)
-    {
-        pthread_mutex_unlock(&state_mutex);
-        return "Error: Only group owner can view requests";
-    }
-
     stringstream ss;
-    for (const auto &r : it->second.pendRequests)
     {
-        ss << r << "\n";
+        ReadLock lock(&groups_lock);
+        auto it = groupDetails.find(groupId);
+
+        if (it == groupDetails.end())
+        {
+            return "group not found";
+        }
+        if (it->second.owner != ownerId)
+        {
+            return "Error: Only group owner can view requests";
+        }
+
+        for (const auto &r : it->second.pendRequests)
+        {
+            ss << r << "\n";
+        }
     }
-    pthread_mutex_unlock(&state_mutex);
     string out = ss.str();
     if (out.empty())
     {
@@ -168,50 +439,46 @@ string list_requests(const string& groupId, const string& ownerId)
 // accept_request now requires ownerId to check authorization
 string accept_request(const string& groupId, const string& userId, const string& ownerId)
 {
-    pthread_mutex_lock(&state_mutex);
+    WriteLock lock(&groups_lock);
     auto it = groupDetails.find(groupId);
     if (it == groupDetails.end())
     {
-        pthread_mutex_unlock(&state_mutex);
         return "group not found";
     }
     if (it->second.owner != ownerId)
     {
-        pthread_mutex_unlock(&state_mutex);
         return "Error: Only the group owner can accept requests.";
     }
     if (it->second.pendRequests.find(userId) == it->second.pendRequests.end())
     {
-        pthread_mutex_unlock(&state_mutex);
         return "Pending request is not found";
     }
     it->second.pendRequests.erase(userId);
     it->second.members.insert(userId);
-    pthread_mutex_unlock(&state_mutex);
     return "OK request accepted";
 }
 
 string logout(const string& userId)
 {
-    pthread_mutex_lock(&state_mutex);
+    WriteLock lock(&addrs_lock);
     // Do not erase credentials on logout; only remove client address
     // If you want to remove user entirely, revert to userDetails.erase
     client_addresses.erase(userId);
-    pthread_mutex_unlock(&state_mutex);
     return "User " + userId + " logged out";
 }
 
-string upload_file(const string &group_id, const string &filename, size_t file_size, const string &whole_sha1, const vector<string> &piece_hashes, const string &uploader_id)
+string upload_file(const string &group_id, const string &filename, size_t file_size, const string &whole_sha1, const string &piece_digests, const string &uploader_id)
 {
-    pthread_mutex_lock(&state_mutex);
-    if (!groupDetails.count(group_id) || !groupDetails[group_id].members.count(uploader_id))
+    ReadLock glock(&groups_lock);
+    if (!is_member(group_id, uploader_id))
     {
-        pthread_mutex_unlock(&state_mutex);
         return "Upload_failed : not member of grp";
     }
 
+    WriteLock flock(&files_lock);
     string key = make_file_key(group_id, filename);
-    if (!fileDetails.count(key))
+    auto it = fileDetails.find(key);
+    if (it == fileDetails.end())
     {
         FileInfo new_file;
         new_file.group_id = group_id;
@@ -219,94 +486,232 @@ string upload_file(const string &group_id, const string &filename, size_t file_s
         new_file.filename = filename;
         new_file.file_size = file_size;
         new_file.whole_file_sha1 = whole_sha1;
-        new_file.piece_hashes = piece_hashes;
-        fileDetails[key] = new_file;
+        new_file.piece_digests = piece_digests;
+        new_file.swarm_removed = ++swarm_clock;
+        it = fileDetails.emplace(key, move(new_file)).first;
+        groupFiles[group_id].insert(filename);
     }
 
-    fileDetails[key].seeders.insert(uploader_id);
-    pthread_mutex_unlock(&state_mutex);
+    // a finished downloader re-uploads; it now has every piece. Clients
+    // drop a PARTIAL entry whose address shows up under SEEDERS, so this
+    // is a change, not a removal.
+    bool added = it->second.seeders.insert(uploader_id).second;
+    bool was_partial = it->second.partial.erase(uploader_id) > 0;
+    if (added || was_partial)
+    {
+        note_swarm_change(it->second, uploader_id);
+    }
     return "File uploaded and shared successfully";
 }
 
 string list_files(const string &group_id, const string &userId)
 {
-    pthread_mutex_lock(&state_mutex);
-    if (!groupDetails.count(group_id) || !groupDetails[group_id].members.count(userId))
-    {
-        pthread_mutex_unlock(&state_mutex);
-        return "Cant fetch list files : not member of grp";
-    }
-
     stringstream ss;
-    for (const auto& pair : fileDetails)
     {
-        if (pair.second.group_id == group_id)
+        ReadLock glock(&groups_lock);
+        if (!is_member(group_id, userId))
+        {
+            return "Cant fetch list files : not member of grp";
+        }
+
+        ReadLock flock(&files_lock);
+        auto files = groupFiles.find(group_id);
+        if (files != groupFiles.end())
         {
-            ss << pair.second.filename << "\n";
+            // set keeps names sorted, so listings come back in a stable order
+            for (const auto& name : files->second)
+            {
+                ss << name << "\n";
+            }
         }
     }
-    pthread_mutex_unlock(&state_mutex);
     string result = ss.str();
     return result.empty() ? "No files in the group" : result;
 }
 
+static string build_fileinfo_prefix(const FileInfo& info)
+{
+    string out = "FILEINFO " + to_string(info.file_size) + " " + info.whole_file_sha1 + " " + to_string(info.num_pieces()) + " ";
+    out.reserve(out.size() + info.num_pieces() * (DIGEST_HEX_CHARS + 1));
+    append_digests_hex(out, info.piece_digests, ' ');
+    return out;
+}
+
+// Appends "SEEDERS <addr>... [PARTIAL <addr> <hex bitfield>...]" for the
+// entries changed after version since (0: all of them), leaving out
+// userId's own entry and users with no address. Caller holds files_lock.
+static void append_swarm(string& out, const FileInfo& info, const string& userId, uint64_t since)
+{
+    auto changed = [&](const string& user) {
+        if (since == 0) return true;
+        auto it = info.swarm_changed.find(user);
+        return it != info.swarm_changed.end() && it->second > since;
+    };
+    out += "SEEDERS";
+    ReadLock alock(&addrs_lock);
+    for (const auto& seeder_id : info.seeders)
+    {
+        auto addr = client_addresses.find(seeder_id);
+        if (addr != client_addresses.end() && changed(seeder_id))
+        {
+            out += " ";
+            out += addr->second;
+        }
+    }
+
+    // " PARTIAL <addr> <hex bitfield> ..." only when someone is mid-download,
+    // so replies for settled files look exactly as before
+    bool tagged = false;
+    for (const auto& holder : info.partial)
+    {
+        auto addr = client_addresses.find(holder.first);
+        if (holder.first == userId || addr == client_addresses.end() || !changed(holder.first))
+        {
+            continue;
+        }
+        if (!tagged)
+        {
+            out += " PARTIAL";
+            tagged = true;
+        }
+        out += " ";
+        out += addr->second;
+        out += " ";
+        append_hex(out, holder.second);
+    }
+}
+
 string get_file(const string &group_id, const string &filename, const string &userId)
 {
-    pthread_mutex_lock(&state_mutex);
-    if (!groupDetails.count(group_id) || !groupDetails[group_id].members.count(userId))
+    ReadLock glock(&groups_lock);
+    if (!is_member(group_id, userId))
     {
-        pthread_mutex_unlock(&state_mutex);
         return "Cant fetch file : not member of grp";
     }
     string key = make_file_key(group_id, filename);
-    if (!fileDetails.count(key))
+    ReadLock flock(&files_lock);
+    auto it = fileDetails.find(key);
+    if (it == fileDetails.end())
     {
-        pthread_mutex_unlock(&state_mutex);
         return "File not found in grp";
     }
 
-    const FileInfo& info = fileDetails[key];
-    stringstream ss;
-    ss << "FILEINFO " << info.file_size << " " << info.whole_file_sha1 << " " << info.piece_hashes.size();
-    for (const auto& hash : info.piece_hashes)
+    const FileInfo& info = it->second;
+    shared_ptr<const string> prefix = atomic_load(&info.fileinfo_prefix);
+    if (!prefix)
     {
-        ss << " " << hash;
+        // two readers may both build it; either copy is identical
+        prefix = make_shared<const string>(build_fileinfo_prefix(info));
+        atomic_store(&info.fileinfo_prefix, prefix);
     }
 
-    ss << " SEEDERS";
-    for (const auto& seeder_id : info.seeders)
+    // the cached piece-hash block is copied as-is; only seeders are rendered
+    string out;
+    out.reserve(prefix->size() + 8 + info.seeders.size() * 22);
+    out += *prefix;
+    append_swarm(out, info, userId, 0);
+    return out;
+}
+
+string get_swarm(const string &group_id, const string &filename, const string &userId, const string &since)
+{
+    ReadLock glock(&groups_lock);
+    if (!is_member(group_id, userId))
+    {
+        return "Cant fetch file : not member of grp";
+    }
+    string key = make_file_key(group_id, filename);
+    ReadLock flock(&files_lock);
+    auto it = fileDetails.find(key);
+    if (it == fileDetails.end())
+    {
+        return "File not found in grp";
+    }
+
+    // entries of this file only change under files_lock exclusive, so
+    // everything rendered below is covered by the clock as read here
+    const FileInfo& info = it->second;
+    uint64_t since_version = parse_swarm_version(since);
+    bool full = since_version == 0 || since_version < info.swarm_removed;
+    string out = "SWARM " + swarm_epoch + "-" + to_string(swarm_clock.load()) + (full ? " FULL " : " DELTA ");
+    append_swarm(out, info, userId, full ? 0 : since_version);
+    return out;
+}
+
+string have_pieces(const string &group_id, const string &filename, const string &userId, const string &bitfield)
+{
+    ReadLock glock(&groups_lock);
+    if (!is_member(group_id, userId))
+    {
+        return "Cant update pieces : not member of grp";
+    }
+    string key = make_file_key(group_id, filename);
+    WriteLock flock(&files_lock);
+    auto it = fileDetails.find(key);
+    if (it == fileDetails.end())
+    {
+        return "File not found in grp";
+    }
+    if (bitfield.size() != bitfield_bytes(it->second.num_pieces()))
     {
-        if (client_addresses.count(seeder_id))
+        return "Bitfield size does not match piece count";
+    }
+    if (!it->second.seeders.count(userId))
+    {
+        string& held = it->second.partial[userId];
+        if (held != bitfield)
+        {
+            held = bitfield;
+            note_swarm_change(it->second, userId);
+        }
+    }
+    return "Pieces updated";
+}
+
+void note_client_expired(const string &userId)
+{
+    WriteLock lock(&files_lock);
+    for (auto& entry : fileDetails)
+    {
+        FileInfo& info = entry.second;
+        if (info.seeders.count(userId) || info.partial.count(userId))
         {
-            ss << " " << client_addresses[seeder_id];
+            note_swarm_removal(info, userId);
         }
     }
-    pthread_mutex_unlock(&state_mutex);
-    return ss.str();
 }
 
 string stop_share(const string &group_id, const string &filename, const string &userId)
 {
-    pthread_mutex_lock(&state_mutex);
-    if (!groupDetails.count(group_id) || !groupDetails[group_id].members.count(userId))
+    ReadLock glock(&groups_lock);
+    if (!is_member(group_id, userId))
     {
-        pthread_mutex_unlock(&state_mutex);
         return "Cant stop share: not member of grp";
     }
     string key = make_file_key(group_id, filename);
-    if (!fileDetails.count(key))
+    WriteLock flock(&files_lock);
+    auto it = fileDetails.find(key);
+    if (it == fileDetails.end())
     {
-        pthread_mutex_unlock(&state_mutex);
         return "File not found in grp";
     }
 
-    fileDetails[key].seeders.erase(userId);
+    if (it->second.seeders.erase(userId) + it->second.partial.erase(userId) > 0)
+    {
+        note_swarm_removal(it->second, userId);
+    }
 
     // Optional cleanup: remove file record if no seeders remain
-    if (fileDetails[key].seeders.empty()) {
-        fileDetails.erase(key);
+    if (it->second.seeders.empty()) {
+        fileDetails.erase(it);
+        auto files = groupFiles.find(group_id);
+        if (files != groupFiles.end()) {
+            files->second.erase(filename);
+            if (files->second.empty()) {
+                groupFiles.erase(files);
+            }
+        }
     }
 
-    pthread_mutex_unlock(&state_mutex);
     return "Stopped sharing file " + filename;
 }
@@ -5,8 +5,13 @@
 #include <vector>
 #include <set>
 #include <map>
+#include <memory>
+#include <functional>
+#include <string_view>
 #include <pthread.h>
 
+#include "metrics.h"
+
 using namespace std;
 
 // --- Data Structures for Tracker State ---
@@ -17,25 +22,144 @@ struct Group {
     set<string> pendRequests;
 };
 
+// SHA-1 piece digests are kept as raw bytes; hex only exists on the wire.
+static const size_t DIGEST_BYTES = 20;
+static const size_t DIGEST_HEX_CHARS = 2 * DIGEST_BYTES;
+
 struct FileInfo {
     string group_id;
     string owner_id;
     string filename;
     string whole_file_sha1;
-    vector<string> piece_hashes;
+    string piece_digests; // num_pieces() * DIGEST_BYTES packed digests
     size_t file_size;
     set<string> seeders; // A set of user_ids who have this file
+    // Downloaders still fetching the file, user_id -> packed piece bitfield
+    // (bit i, most significant first, set once piece i is verified).
+    map<string, string> partial;
+    // Serialized "FILEINFO <size> <sha1> <n> <hashes...> " prefix of the
+    // get_file reply, built on first request. It only covers fields fixed
+    // when upload_file creates the record, so it lives exactly as long as
+    // the record does (stop_share drops both with the last seeder). Read and
+    // published with atomic_load/atomic_store since readers only hold
+    // files_lock shared.
+    mutable shared_ptr<const string> fileinfo_prefix;
+    // get_swarm deltas. Versions come from one tracker-wide clock:
+    // swarm_changed has the version at which each seeder or holder entry
+    // last changed; swarm_removed is the last version at which one went
+    // away (or the record was created). A delta cannot express removals,
+    // so a client older than swarm_removed gets the full list.
+    map<string, uint64_t> swarm_changed;
+    uint64_t swarm_removed = 0;
+
+    size_t num_pieces() const { return piece_digests.size() / DIGEST_BYTES; }
 };
 
+// Decodes one 40-char hex digest onto the end of out; false if malformed.
+bool append_digest_from_hex(string& out, string_view hex);
+// Appends the hex form of each packed digest, each followed by separator.
+void append_digests_hex(string& out, const string& digests, char separator);
+// Generic hex <-> bytes for piece bitfields; false if hex is malformed.
+bool append_bytes_from_hex(string& out, string_view hex);
+void append_hex(string& out, const string& bytes);
+inline size_t bitfield_bytes(size_t num_pieces) { return (num_pieces + 7) / 8; }
+
 // --- Global State Variables ---
+// Each map has its own reader/writer lock. When more than one is needed
+// they are always taken in the order groups -> files -> addrs; users_lock
+// is never held together with another state lock, except by replace_state,
+// which takes it after all the others.
 extern map<string, string> userDetails;
 extern map<string, Group> groupDetails;
 extern map<string, FileInfo> fileDetails;
+// Secondary index group_id -> filenames, kept in step with fileDetails
+// under files_lock so a group listing never scans other groups' files.
+extern map<string, set<string>> groupFiles;
 extern map<string, string> client_addresses; 
-extern pthread_mutex_t state_mutex;
+// Resumable login sessions, user -> token and token -> user, guarded by
+// users_lock. A token stays valid until an explicit logout.
+extern map<string, string> session_tokens;
+extern map<string, string> token_users;
+extern pthread_rwlock_t users_lock;
+extern pthread_rwlock_t groups_lock;
+extern pthread_rwlock_t files_lock;
+extern pthread_rwlock_t addrs_lock;
+
+// Set on the thread inside replace_state(), which already holds every
+// state lock exclusively; ReadLock/WriteLock do nothing on that thread.
+extern thread_local bool holding_all_state_locks;
+
+// Scoped shared/exclusive holds on one of the state locks. Both record how
+// long they waited for the lock and how long they held it (metrics.h).
+class ReadLock {
+public:
+    explicit ReadLock(pthread_rwlock_t* l) : lock(holding_all_state_locks ? nullptr : l), metrics(lock_metrics_for(l)) {
+        if (!lock) return;
+        uint64_t start = metrics_now_ns();
+        pthread_rwlock_rdlock(lock);
+        acquired = metrics_now_ns();
+        metrics->wait[LOCK_SHARED].record(acquired - start);
+    }
+    ~ReadLock() {
+        if (!lock) return;
+        metrics->hold[LOCK_SHARED].record(metrics_now_ns() - acquired);
+        pthread_rwlock_unlock(lock);
+    }
+    ReadLock(const ReadLock&) = delete;
+    ReadLock& operator=(const ReadLock&) = delete;
+private:
+    pthread_rwlock_t* lock;
+    LockMetrics* metrics;
+    uint64_t acquired;
+};
+
+class WriteLock {
+public:
+    explicit WriteLock(pthread_rwlock_t* l) : lock(holding_all_state_locks ? nullptr : l), metrics(lock_metrics_for(l)) {
+        if (!lock) return;
+        uint64_t start = metrics_now_ns();
+        pthread_rwlock_wrlock(lock);
+        acquired = metrics_now_ns();
+        metrics->wait[LOCK_EXCLUSIVE].record(acquired - start);
+    }
+    ~WriteLock() {
+        if (!lock) return;
+        metrics->hold[LOCK_EXCLUSIVE].record(metrics_now_ns() - acquired);
+        pthread_rwlock_unlock(lock);
+    }
+    WriteLock(const WriteLock&) = delete;
+    WriteLock& operator=(const WriteLock&) = delete;
+private:
+    pthread_rwlock_t* lock;
+    LockMetrics* metrics;
+    uint64_t acquired;
+};
 
 string make_file_key(const string& group_id,const string& filename);
 
+// Small locked accessors for callers outside details.cpp
+string group_owner(const string& groupId);
+void set_client_address(const string& username, const string& client_addr);
+bool copy_file_info(const string& key, FileInfo& out);
+
+// Session tokens let a client attach any connection, on any tracker, to
+// its login without sending the password again (the resume command).
+// session_token_for returns the user's current token, issuing one if needed.
+string session_token_for(const string& username);
+void set_session_token(const string& username, const string& token);
+// Empty if the token is unknown or revoked.
+string user_for_token(const string& token);
+void revoke_session_token(const string& username);
+
+
+// Snapshot / full-state restore: merge a whole record into the state
+// without the membership checks of the client-facing commands.
+void restore_group(const string& groupId, const string& owner, const vector<string>& members, const vector<string>& pending);
+void restore_file(const string& group_id, const string& filename, size_t file_size, const string& whole_sha1, const string& piece_digests, const string& owner_id, const vector<string>& seeders, const vector<pair<string, string>>& partial);
+// Clears all users, groups, files, sessions and addresses and runs rebuild
+// (typically restore_* calls) with every state lock held exclusively, so
+// no reader sees the state half replaced.
+void replace_state(const function<void()>& rebuild);
 
 // User & Group Management
 string create_user(const string& username, const string& password);
@@ -49,9 +173,20 @@ string accept_request(const string& groupId, const string& userId_to_accept, con
 string logout(const string& userId);
 
 // File Management
-string upload_file(const string& group_id, const string& filename, size_t file_size, const string& whole_sha1, const vector<string>& piece_hashes, const string& uploader_id);
+string upload_file(const string& group_id, const string& filename, size_t file_size, const string& whole_sha1, const string& piece_digests, const string& uploader_id);
 string list_files(const string& group_id, const string& userId);
 string get_file(const string& group_id, const string& filename, const string& userId);
+// Just the swarm part of get_file, for downloaders refreshing their peers:
+// "SWARM <version> FULL|DELTA SEEDERS ... [PARTIAL ...]". since is the
+// version from an earlier reply (empty for none); a DELTA lists only the
+// seeders and holders changed after it.
+string get_swarm(const string& group_id, const string& filename, const string& userId, const string& since);
+// Records which pieces a downloader already holds (packed bitfield), so
+// get_file can hand it out as a partial seeder.
+string have_pieces(const string& group_id, const string& filename, const string& userId, const string& bitfield);
+// Counts userId as removed from the swarm of every file it seeds or holds
+// pieces of, so get_swarm stops sending deltas past its expired address.
+void note_client_expired(const string& userId);
 
 
 string stop_share(const string &group_id, const string &filename, const string &userId);
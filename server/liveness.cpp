@@ -0,0 +1,138 @@
+// liveness.cpp
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "details.h"
+#include "liveness.h"
+
+using namespace std;
+
+// One slot per second. TTLs longer than the wheel simply stay in their slot
+// for more than one revolution.
+static const uint64_t WHEEL_SLOTS = 64;
+
+// Lock order: live_mutex -> addrs_lock. The sweeper logs users out while
+// holding live_mutex, and refresh_client() sets the address and the new
+// deadline under it too, so a heartbeat is either swept before it (and
+// puts the address back) or seen by the sweep.
+static pthread_mutex_t live_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unordered_map<string, uint64_t> deadlines;   // user -> expiry tick
+// users due at tick t sit in wheel[t % WHEEL_SLOTS]; entries made stale by
+// a later touch or a logout are skipped when their slot comes up
+static vector<string> wheel[WHEEL_SLOTS];
+static uint64_t swept_tick = 0;                     // every tick before this is done
+static uint64_t ttl_ticks = 0;
+static uint64_t expired_total = 0;
+static chrono::steady_clock::time_point wheel_start = chrono::steady_clock::now();
+
+static uint64_t now_tick()
+{
+    return chrono::duration_cast<chrono::seconds>(chrono::steady_clock::now() - wheel_start).count();
+}
+
+// Caller holds live_mutex.
+static void arm_deadline(const string& user)
+{
+    uint64_t deadline = max(now_tick(), swept_tick) + ttl_ticks;
+    uint64_t& current = deadlines[user];
+    // several touches within one second share a wheel entry
+    if (current != deadline) {
+        current = deadline;
+        wheel[deadline % WHEEL_SLOTS].push_back(user);
+    }
+}
+
+void touch_client(const string& user)
+{
+    if (ttl_ticks == 0 || user.empty()) return;
+    pthread_mutex_lock(&live_mutex);
+    arm_deadline(user);
+    pthread_mutex_unlock(&live_mutex);
+}
+
+void refresh_client(const string& user, const string& addr)
+{
+    if (ttl_ticks == 0 || user.empty()) {
+        set_client_address(user, addr);
+        return;
+    }
+    pthread_mutex_lock(&live_mutex);
+    set_client_address(user, addr);
+    arm_deadline(user);
+    pthread_mutex_unlock(&live_mutex);
+}
+
+void forget_client(const string& user)
+{
+    if (ttl_ticks == 0) return;
+    pthread_mutex_lock(&live_mutex);
+    deadlines.erase(user);
+    pthread_mutex_unlock(&live_mutex);
+}
+
+// Expires everything due at tick, adding those users to expired. Caller
+// holds live_mutex.
+static void sweep_slot(uint64_t tick, vector<string>& expired)
+{
+    vector<string>& slot = wheel[tick % WHEEL_SLOTS];
+    vector<string> later;
+    for (const string& user : slot) {
+        auto it = deadlines.find(user);
+        if (it == deadlines.end() || it->second % WHEEL_SLOTS != tick % WHEEL_SLOTS) continue; // stale
+        if (it->second > tick) {
+            // due on a later revolution
+            later.push_back(user);
+            continue;
+        }
+        deadlines.erase(it);
+        logout(user);
+        expired.push_back(user);
+        expired_total++;
+        cout << "[LIVENESS] No heartbeat from " << user << ", address expired" << endl;
+    }
+    slot.swap(later);
+}
+
+static void* liveness_sweeper(void* arg)
+{
+    while (1) {
+        sleep(1);
+        vector<string> expired;
+        pthread_mutex_lock(&live_mutex);
+        uint64_t now = now_tick();
+        for (; swept_tick <= now; ++swept_tick) {
+            sweep_slot(swept_tick, expired);
+        }
+        pthread_mutex_unlock(&live_mutex);
+        // outside live_mutex: this walks every file record
+        for (const string& user : expired) {
+            note_client_expired(user);
+        }
+    }
+    return nullptr;
+}
+
+void start_liveness(int ttl_sec)
+{
+    if (ttl_sec <= 0) return;
+    ttl_ticks = ttl_sec;
+    pthread_t id;
+    pthread_create(&id, nullptr, liveness_sweeper, nullptr);
+    pthread_detach(id);
+    cout << "[LIVENESS] Client addresses expire after " << ttl_sec << "s without a heartbeat" << endl;
+}
+
+LivenessStats get_liveness_stats()
+{
+    pthread_mutex_lock(&live_mutex);
+    LivenessStats st;
+    st.tracked = deadlines.size();
+    st.expired = expired_total;
+    pthread_mutex_unlock(&live_mutex);
+    return st;
+}
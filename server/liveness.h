@@ -0,0 +1,37 @@
+#ifndef LIVENESS_H
+#define LIVENESS_H
+
+#include <cstdint>
+#include <string>
+
+using namespace std;
+
+// Client liveness: every login or heartbeat re-arms a TTL for the user's
+// listen address, and a sweeper thread drops addresses whose TTL ran out,
+// so get_file stops handing out peers that crashed without logging out.
+// Deadlines sit in a timing wheel of one-second slots; each tick only
+// looks at the users due in that slot instead of scanning every address.
+//
+// Heartbeats are replicated (SYNC|heartbeat|user|addr|) so every tracker
+// keeps its own wheel; expiry itself is local and never replicated.
+
+// Sets the TTL and starts the sweeper. ttl_sec 0 disables expiry. Call
+// before state is recovered so replayed logins are armed too.
+void start_liveness(int ttl_sec);
+// Re-arms user's TTL (login or heartbeat).
+void touch_client(const string& user);
+// Sets user's listen address and re-arms its TTL in one hold of the
+// liveness lock, so an expiry sweep cannot run in between and drop the
+// address just set.
+void refresh_client(const string& user, const string& addr);
+// Stops tracking user after an explicit logout.
+void forget_client(const string& user);
+
+struct LivenessStats
+{
+    uint64_t tracked = 0;   // users with a live TTL
+    uint64_t expired = 0;   // addresses dropped by the sweeper
+};
+LivenessStats get_liveness_stats();
+
+#endif
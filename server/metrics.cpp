@@ -0,0 +1,206 @@
+// metrics.cpp
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "details.h"
+#include "metrics.h"
+
+using namespace std;
+
+static const char* COMMAND_NAMES[] = {
+    "HELLO", "create_user", "login", "resume", "logout", "create_group", "join_group",
+    "leave_group", "list_groups", "list_requests", "accept_request",
+    "upload_file", "list_files", "get_file", "get_swarm", "have_pieces", "stop_share", "heartbeat",
+    "sync_stats", "stats", "other",
+};
+static const int NUM_COMMANDS = sizeof(COMMAND_NAMES) / sizeof(COMMAND_NAMES[0]);
+
+static LatencyHistogram command_latency[NUM_COMMANDS];
+static atomic<uint64_t> malformed_requests;
+static atomic<int64_t> active_sessions;
+
+static LockMetrics lock_slots[] = {
+    {"users", {}, {}}, {"groups", {}, {}}, {"files", {}, {}}, {"addrs", {}, {}}, {"other", {}, {}},
+};
+
+void LatencyHistogram::record(uint64_t ns)
+{
+    uint64_t us = ns / 1000;
+    int bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+    if (bucket >= LATENCY_BUCKETS) bucket = LATENCY_BUCKETS - 1;
+    buckets[bucket].fetch_add(1, memory_order_relaxed);
+    count.fetch_add(1, memory_order_relaxed);
+    sum_ns.fetch_add(ns, memory_order_relaxed);
+}
+
+int command_metric_index(string_view command)
+{
+    for (int i = 0; i < NUM_COMMANDS - 1; ++i) {
+        if (command == COMMAND_NAMES[i]) return i;
+    }
+    return NUM_COMMANDS - 1;
+}
+
+void record_command(int index, uint64_t ns)
+{
+    command_latency[index].record(ns);
+}
+
+void record_malformed_request()
+{
+    malformed_requests.fetch_add(1, memory_order_relaxed);
+}
+
+LockMetrics* lock_metrics_for(pthread_rwlock_t* lock)
+{
+    if (lock == &users_lock) return &lock_slots[0];
+    if (lock == &groups_lock) return &lock_slots[1];
+    if (lock == &files_lock) return &lock_slots[2];
+    if (lock == &addrs_lock) return &lock_slots[3];
+    return &lock_slots[4];
+}
+
+void session_opened() { active_sessions.fetch_add(1, memory_order_relaxed); }
+void session_closed() { active_sessions.fetch_sub(1, memory_order_relaxed); }
+
+static void append_sample(string& out, const char* name, const char* type, uint64_t value)
+{
+    out += "# TYPE ";
+    out += name;
+    out += ' ';
+    out += type;
+    out += '\n';
+    out += name;
+    out += ' ';
+    out += to_string(value);
+    out += '\n';
+}
+
+void append_gauge(string& out, const char* name, uint64_t value)
+{
+    append_sample(out, name, "gauge", value);
+}
+
+void append_counter(string& out, const char* name, uint64_t value)
+{
+    append_sample(out, name, "counter", value);
+}
+
+// Writes one histogram as cumulative _bucket lines plus _sum and _count.
+// Buckets above the slowest sample are left out; "+Inf" closes the series.
+static void append_histogram(string& out, const string& name, const string& labels, const LatencyHistogram& h)
+{
+    uint64_t counts[LATENCY_BUCKETS];
+    int top = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; ++i) {
+        counts[i] = h.buckets[i].load(memory_order_relaxed);
+        if (counts[i]) top = i;
+    }
+    uint64_t cumulative = 0;
+    for (int i = 0; i <= top && i < LATENCY_BUCKETS - 1; ++i) {
+        cumulative += counts[i];
+        out += name + "_bucket{" + labels + ",le=\"" + to_string(1ull << i) + "\"} " + to_string(cumulative) + "\n";
+    }
+    uint64_t total = h.count.load(memory_order_relaxed);
+    out += name + "_bucket{" + labels + ",le=\"+Inf\"} " + to_string(total) + "\n";
+    out += name + "_sum{" + labels + "} " + to_string(h.sum_ns.load(memory_order_relaxed) / 1000) + "\n";
+    out += name + "_count{" + labels + "} " + to_string(total) + "\n";
+}
+
+void render_metrics(string& out)
+{
+    out += "# TYPE tracker_command_latency_us histogram\n";
+    for (int i = 0; i < NUM_COMMANDS; ++i) {
+        if (command_latency[i].count.load(memory_order_relaxed) == 0) continue;
+        append_histogram(out, "tracker_command_latency_us", string("command=\"") + COMMAND_NAMES[i] + "\"", command_latency[i]);
+    }
+
+    // each metric's samples must follow its own TYPE line, so all wait
+    // histograms go out before the hold ones
+    static const char* MODES[] = {"shared", "exclusive"};
+    for (bool hold : {false, true}) {
+        const char* name = hold ? "tracker_lock_hold_us" : "tracker_lock_wait_us";
+        out += string("# TYPE ") + name + " histogram\n";
+        for (const LockMetrics& slot : lock_slots) {
+            for (int m = 0; m < 2; ++m) {
+                if (slot.wait[m].count.load(memory_order_relaxed) == 0) continue;
+                string labels = string("lock=\"") + slot.name + "\",mode=\"" + MODES[m] + "\"";
+                append_histogram(out, name, labels, hold ? slot.hold[m] : slot.wait[m]);
+            }
+        }
+    }
+
+    append_gauge(out, "tracker_sessions_active", max<int64_t>(0, active_sessions.load(memory_order_relaxed)));
+    append_counter(out, "tracker_malformed_requests_total", malformed_requests.load(memory_order_relaxed));
+}
+
+static int stats_fd = -1;
+static string (*stats_render)() = nullptr;
+
+static void* stats_server(void* arg)
+{
+    while (1) {
+        int conn = accept(stats_fd, nullptr, nullptr);
+        if (conn < 0) {
+            if (errno != EINTR) perror("[STATS] accept");
+            continue;
+        }
+        // the request itself is not interpreted: every path gets the metrics
+        timeval tv{};
+        tv.tv_sec = 1;
+        setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        char req[1024];
+        recv(conn, req, sizeof(req), 0);
+
+        string body = stats_render();
+        string reply = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+                     + to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+        size_t sent = 0;
+        while (sent < reply.size()) {
+            ssize_t n = send(conn, reply.data() + sent, reply.size() - sent, 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            sent += n;
+        }
+        close(conn);
+    }
+    return nullptr;
+}
+
+bool start_stats_server(int port, string (*render)())
+{
+    stats_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (stats_fd < 0) {
+        perror("[STATS] socket");
+        return false;
+    }
+    int opt = 1;
+    setsockopt(stats_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    // loopback only: the metrics are for local scrapers
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (::bind(stats_fd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(stats_fd, 16) < 0) {
+        perror("[STATS] bind");
+        close(stats_fd);
+        stats_fd = -1;
+        return false;
+    }
+
+    stats_render = render;
+    pthread_t id;
+    pthread_create(&id, nullptr, stats_server, nullptr);
+    pthread_detach(id);
+    cout << "[STATS] Serving metrics on 127.0.0.1:" << port << endl;
+    return true;
+}
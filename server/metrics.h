@@ -0,0 +1,67 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <pthread.h>
+
+using namespace std;
+
+// Built-in tracker instrumentation. Everything is recorded with relaxed
+// atomics so the hot paths never take a lock for it; render_metrics()
+// reads the counters without stopping writers, so one scrape may be a few
+// samples out of step between series.
+
+// Power-of-two latency histogram. Bucket i counts samples below 2^i
+// microseconds; the last bucket also takes everything slower.
+static const int LATENCY_BUCKETS = 32;
+
+struct LatencyHistogram {
+    atomic<uint64_t> buckets[LATENCY_BUCKETS];
+    atomic<uint64_t> count;
+    atomic<uint64_t> sum_ns;
+
+    void record(uint64_t ns);
+};
+
+inline uint64_t metrics_now_ns()
+{
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Client commands are counted per name; anything not listed in
+// metrics.cpp is folded into "other".
+int command_metric_index(string_view command);
+void record_command(int index, uint64_t ns);
+void record_malformed_request();
+
+// Wait and hold time for the tracker state locks (see ReadLock/WriteLock
+// in details.h), split by shared/exclusive mode.
+enum LockMode { LOCK_SHARED = 0, LOCK_EXCLUSIVE = 1 };
+struct LockMetrics {
+    const char* name;
+    LatencyHistogram wait[2];
+    LatencyHistogram hold[2];
+};
+// Metrics slot for one of the state locks; an untracked lock shares an
+// "other" slot.
+LockMetrics* lock_metrics_for(pthread_rwlock_t* lock);
+
+// Open client connections, in either port mode.
+void session_opened();
+void session_closed();
+
+// Appends every series above in the Prometheus text exposition format.
+void render_metrics(string& out);
+// Appends one "name value" sample, preceded by its "# TYPE" line.
+void append_gauge(string& out, const char* name, uint64_t value);
+void append_counter(string& out, const char* name, uint64_t value);
+
+// Serves render() over plain HTTP on a local port from a background
+// thread, for scrapers that should not log in as a client.
+bool start_stats_server(int port, string (*render)());
+
+#endif
@@ -0,0 +1,416 @@
+// persist.cpp
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "persist.h"
+#include "sync.h"
+
+using namespace std;
+
+static const char* SNAPSHOT_MAGIC = "TRACKER_SNAPSHOT";
+static const int SNAPSHOT_VERSION = 1;
+static const size_t SNAPSHOT_WRITE_CHUNK = 1024 * 1024;
+// backoff between attempts to write a batch the disk refused
+static const int WAL_RETRY_BASE_MS = 10;
+static const int WAL_RETRY_MAX_MS = 1000;
+
+static bool persistence_enabled = false;
+static string data_dir;
+static int snapshot_interval = 60;
+
+static pthread_mutex_t wal_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wal_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t wal_durable = PTHREAD_COND_INITIALIZER;
+static string wal_pending;          // records not yet handed to the writer
+static uint64_t pending_first_lsn = 0;
+static uint64_t next_lsn = 1;
+static uint64_t durable_lsn = 0;
+static uint64_t snapshot_lsn = 0;
+// set after recovery and after each snapshot: the next batch opens a new segment
+static bool rotate_wal = true;
+static PersistStats stats;
+static atomic<void (*)(uint64_t)> durable_callback(nullptr);
+
+// only touched by the writer thread
+static int wal_fd = -1;
+
+static string snapshot_path() { return data_dir + "/snapshot"; }
+
+static string segment_path(uint64_t first_lsn)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "wal.%020llu", (unsigned long long)first_lsn);
+    return data_dir + "/" + name;
+}
+
+static bool sync_file(int fd)
+{
+#ifdef __linux__
+    return fdatasync(fd) == 0;
+#else
+    return fsync(fd) == 0;
+#endif
+}
+
+static void sync_dir()
+{
+    int fd = open(data_dir.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+static bool write_all(int fd, const char* data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+// WAL segments sorted by the first lsn they hold.
+static vector<uint64_t> list_segments()
+{
+    vector<uint64_t> starts;
+    DIR* d = opendir(data_dir.c_str());
+    if (!d) return starts;
+    while (dirent* e = readdir(d)) {
+        unsigned long long first;
+        if (strncmp(e->d_name, "wal.", 4) == 0 && sscanf(e->d_name + 4, "%llu", &first) == 1) {
+            starts.push_back(first);
+        }
+    }
+    closedir(d);
+    sort(starts.begin(), starts.end());
+    return starts;
+}
+
+// Calls fn for every complete line of the file at path, read through mmap.
+// A torn last line (no trailing newline) is ignored.
+template <typename F>
+static bool for_each_line(const string& path, F fn)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return st.st_size == 0;
+    }
+    size_t len = st.st_size;
+    void* map = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return false;
+    }
+    madvise(map, len, MADV_SEQUENTIAL);
+
+    const char* p = (const char*)map;
+    const char* end = p + len;
+    while (p < end) {
+        const char* nl = (const char*)memchr(p, '\n', end - p);
+        if (!nl) break;
+        if (!fn(p, (size_t)(nl - p))) break;
+        p = nl + 1;
+    }
+    munmap(map, len);
+    return true;
+}
+
+static void recover()
+{
+    auto start = chrono::steady_clock::now();
+    size_t snapshot_records = 0, wal_records = 0;
+    uint64_t max_lsn = 0;
+
+    bool header = true;
+    for_each_line(snapshot_path(), [&](const char* line, size_t len) {
+        if (header) {
+            header = false;
+            char magic[32];
+            int version;
+            unsigned long long lsn;
+            string h(line, len);
+            if (sscanf(h.c_str(), "%31s %d %llu", magic, &version, &lsn) != 3
+                || strcmp(magic, SNAPSHOT_MAGIC) != 0 || version != SNAPSHOT_VERSION) {
+                cerr << "[PERSIST] Unrecognized snapshot header, ignoring snapshot\n";
+                return false;
+            }
+            snapshot_lsn = lsn;
+            return true;
+        }
+        apply_sync_message(string(line, len));
+        snapshot_records++;
+        return true;
+    });
+    max_lsn = snapshot_lsn;
+
+    for (uint64_t first : list_segments()) {
+        for_each_line(segment_path(first), [&](const char* line, size_t len) {
+            const char* sp = (const char*)memchr(line, ' ', len);
+            if (!sp) return true;
+            uint64_t lsn = strtoull(string(line, sp - line).c_str(), nullptr, 10);
+            if (lsn > snapshot_lsn) {
+                apply_sync_message(string(sp + 1, line + len - sp - 1));
+                wal_records++;
+            }
+            max_lsn = max(max_lsn, lsn);
+            return true;
+        });
+    }
+
+    next_lsn = max_lsn + 1;
+    durable_lsn = max_lsn;
+    stats.last_lsn = max_lsn;
+
+    auto ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+    cout << "[PERSIST] Recovered " << snapshot_records << " snapshot records and " << wal_records
+         << " WAL records in " << ms << " ms (lsn " << max_lsn << ")" << endl;
+}
+
+// Queues one record for the writer. Caller holds wal_mutex.
+static uint64_t append_pending(const string& msg)
+{
+    size_t len = msg.size();
+    if (len > 0 && msg[len - 1] == '\n') len--;
+
+    uint64_t lsn = next_lsn++;
+    if (wal_pending.empty()) pending_first_lsn = lsn;
+    wal_pending += to_string(lsn);
+    wal_pending += ' ';
+    wal_pending.append(msg, 0, len);
+    wal_pending += '\n';
+    return lsn;
+}
+
+// Wakes the writer and, with wait_durable, waits until lsn is fsynced.
+// Called with wal_mutex held; releases it.
+static void commit_pending(uint64_t lsn, bool wait_durable)
+{
+    pthread_cond_signal(&wal_work);
+    if (wait_durable) {
+        while (durable_lsn < lsn) {
+            pthread_cond_wait(&wal_durable, &wal_mutex);
+        }
+    }
+    pthread_mutex_unlock(&wal_mutex);
+}
+
+uint64_t wal_append(const string& msg, bool wait_durable)
+{
+    if (!persistence_enabled) return 0;
+
+    pthread_mutex_lock(&wal_mutex);
+    uint64_t lsn = append_pending(msg);
+    commit_pending(lsn, wait_durable);
+    return lsn;
+}
+
+void wal_append_all(const vector<string>& msgs, bool wait_durable)
+{
+    if (!persistence_enabled || msgs.empty()) return;
+
+    pthread_mutex_lock(&wal_mutex);
+    uint64_t lsn = 0;
+    for (const string& msg : msgs) {
+        lsn = append_pending(msg);
+    }
+    commit_pending(lsn, wait_durable);
+}
+
+uint64_t wal_durable_lsn()
+{
+    pthread_mutex_lock(&wal_mutex);
+    uint64_t lsn = durable_lsn;
+    pthread_mutex_unlock(&wal_mutex);
+    return lsn;
+}
+
+void set_wal_durable_callback(void (*callback)(uint64_t durable_lsn))
+{
+    durable_callback = callback;
+}
+
+PersistStats get_persist_stats()
+{
+    pthread_mutex_lock(&wal_mutex);
+    PersistStats st = stats;
+    st.last_lsn = next_lsn - 1;
+    st.durable_lsn = durable_lsn;
+    st.snapshot_lsn = snapshot_lsn;
+    pthread_mutex_unlock(&wal_mutex);
+    return st;
+}
+
+// Appends batch to the current segment, opening one named after first when
+// rotate is set or the last attempt closed it, and fsyncs it. On failure the
+// segment is cut back to where the batch started and closed, so a retry
+// neither repeats nor tears records.
+static bool write_batch(const string& batch, uint64_t first, bool rotate)
+{
+    if (rotate || wal_fd < 0) {
+        if (wal_fd >= 0) close(wal_fd);
+        wal_fd = open(segment_path(first).c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (wal_fd < 0) {
+            perror("[PERSIST] open wal segment");
+            return false;
+        }
+        sync_dir();
+    }
+
+    off_t start = lseek(wal_fd, 0, SEEK_END);
+    if (start >= 0 && write_all(wal_fd, batch.data(), batch.size()) && sync_file(wal_fd)) {
+        return true;
+    }
+    perror("[PERSIST] wal write");
+    if (start >= 0 && ftruncate(wal_fd, start) != 0) perror("[PERSIST] wal truncate");
+    close(wal_fd);
+    wal_fd = -1;
+    return false;
+}
+
+// Group commit: everything appended while the previous batch was being
+// written and fsynced goes out in the next single write + fsync.
+static void* wal_writer(void* arg)
+{
+    string batch;
+    while (1) {
+        pthread_mutex_lock(&wal_mutex);
+        while (wal_pending.empty()) {
+            pthread_cond_wait(&wal_work, &wal_mutex);
+        }
+        batch.clear();
+        batch.swap(wal_pending);
+        uint64_t first = pending_first_lsn;
+        uint64_t last = next_lsn - 1;
+        bool rotate = rotate_wal;
+        rotate_wal = false;
+        pthread_mutex_unlock(&wal_mutex);
+
+        // Nothing in the batch is durable until it is on disk: waiting
+        // callers and held-back replies keep waiting while it is retried.
+        int delay_ms = WAL_RETRY_BASE_MS;
+        while (!write_batch(batch, first, rotate)) {
+            pthread_mutex_lock(&wal_mutex);
+            stats.write_failures++;
+            pthread_mutex_unlock(&wal_mutex);
+            usleep(delay_ms * 1000);
+            delay_ms = min(delay_ms * 2, WAL_RETRY_MAX_MS);
+        }
+
+        pthread_mutex_lock(&wal_mutex);
+        durable_lsn = last;
+        stats.fsyncs++;
+        stats.records_written += count(batch.begin(), batch.end(), '\n');
+        pthread_cond_broadcast(&wal_durable);
+        pthread_mutex_unlock(&wal_mutex);
+
+        if (auto callback = durable_callback.load()) callback(last);
+    }
+    return nullptr;
+}
+
+static bool write_snapshot(uint64_t lsn)
+{
+    string tmp = snapshot_path() + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("[PERSIST] open snapshot");
+        return false;
+    }
+
+    string buf = string(SNAPSHOT_MAGIC) + " " + to_string(SNAPSHOT_VERSION) + " " + to_string(lsn) + "\n";
+    bool ok = true;
+    size_t records = 0;
+    dump_state_as_sync([&](const string& line) {
+        buf += line;
+        buf += '\n';
+        records++;
+        if (buf.size() >= SNAPSHOT_WRITE_CHUNK) {
+            ok = ok && write_all(fd, buf.data(), buf.size());
+            buf.clear();
+        }
+    });
+    ok = ok && write_all(fd, buf.data(), buf.size());
+    if (ok) fsync(fd);
+    close(fd);
+
+    if (!ok || rename(tmp.c_str(), snapshot_path().c_str()) != 0) {
+        perror("[PERSIST] write snapshot");
+        unlink(tmp.c_str());
+        return false;
+    }
+    sync_dir();
+    cout << "[PERSIST] Snapshot at lsn " << lsn << " (" << records << " records)" << endl;
+    return true;
+}
+
+static void* snapshot_loop(void* arg)
+{
+    while (1) {
+        sleep(snapshot_interval);
+
+        // Every record up to lsn has already been applied to the maps, so the
+        // dump below contains it; later records are replayed from the WAL
+        // (replaying something the dump also caught is harmless).
+        pthread_mutex_lock(&wal_mutex);
+        uint64_t lsn = next_lsn - 1;
+        bool dirty = lsn > snapshot_lsn;
+        pthread_mutex_unlock(&wal_mutex);
+        if (!dirty || !write_snapshot(lsn)) continue;
+
+        pthread_mutex_lock(&wal_mutex);
+        snapshot_lsn = lsn;
+        rotate_wal = true;
+        pthread_mutex_unlock(&wal_mutex);
+
+        // a segment is obsolete once the next one starts at or before lsn + 1
+        vector<uint64_t> segments = list_segments();
+        for (size_t i = 0; i + 1 < segments.size(); ++i) {
+            if (segments[i + 1] <= lsn + 1) {
+                unlink(segment_path(segments[i]).c_str());
+            }
+        }
+    }
+    return nullptr;
+}
+
+bool start_persistence(const string& dir, int snapshot_interval_sec)
+{
+    data_dir = dir;
+    snapshot_interval = max(1, snapshot_interval_sec);
+    if (mkdir(data_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        perror("[PERSIST] mkdir");
+        return false;
+    }
+
+    recover();
+    persistence_enabled = true;
+
+    pthread_t writer, snapshotter;
+    pthread_create(&writer, nullptr, wal_writer, nullptr);
+    pthread_detach(writer);
+    pthread_create(&snapshotter, nullptr, snapshot_loop, nullptr);
+    pthread_detach(snapshotter);
+    cout << "[PERSIST] Logging state changes to " << data_dir << endl;
+    return true;
+}
@@ -0,0 +1,48 @@
+#ifndef PERSIST_H
+#define PERSIST_H
+
+#include<cstdint>
+#include<string>
+#include<vector>
+
+using namespace std;
+
+// Durable tracker state: every state mutation (the same "SYNC|..." line that
+// is replicated to the peer tracker) is appended to a write-ahead log, and
+// the whole state is periodically written out as a compact snapshot. On
+// start the snapshot is mmapped and replayed, followed by the WAL records
+// newer than it.
+//
+// Data directory layout:
+//   snapshot          "TRACKER_SNAPSHOT 1 <lsn>" header, then SYNC lines
+//   wal.<first lsn>   "<lsn> SYNC|..." lines; a new segment is started after
+//                     each snapshot and segments fully covered by it deleted
+
+// Recovers state from dir (created if missing) and starts the WAL writer
+// and snapshot threads. Must run before clients or peers are served.
+bool start_persistence(const string& dir, int snapshot_interval_sec);
+
+// Logs one mutation and returns its LSN. With wait_durable the call
+// returns only after the record has been fsynced; concurrent callers share
+// one fsync (group commit). No-op returning 0 when persistence is disabled.
+uint64_t wal_append(const string& msg, bool wait_durable=true);
+// Logs several mutations as consecutive records in the same batch.
+void wal_append_all(const vector<string>& msgs, bool wait_durable=true);
+// LSN of the newest fsynced record.
+uint64_t wal_durable_lsn();
+// Registers a function the WAL writer calls, on its own thread, after each
+// fsync with the new durable LSN (for callers that did not wait).
+void set_wal_durable_callback(void (*callback)(uint64_t durable_lsn));
+
+struct PersistStats
+{
+    uint64_t last_lsn=0;
+    uint64_t durable_lsn=0;
+    uint64_t snapshot_lsn=0;
+    uint64_t fsyncs=0;
+    uint64_t records_written=0;
+    uint64_t write_failures=0;  // batch writes or fsyncs that had to be retried
+};
+PersistStats get_persist_stats();
+
+#endif
@@ -0,0 +1,242 @@
+// reactor.cpp
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "client_handler.h"
+#include "metrics.h"
+#include "persist.h"
+#include "../common/poller.h"
+#include "reactor.h"
+
+using namespace std;
+
+struct Connection
+{
+    ClientSession session;
+    string inbuf;
+    string outbuf;
+    bool closed = false;
+};
+
+static Poller poller;
+static int listen_fd = -1;
+// Address used as the poller tag for the listening socket.
+static char listen_tag;
+
+static deque<Connection*> ready_queue;
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+// Connections whose replies wait for their WAL records to be fsynced, by
+// the LSN they need. Workers park them here instead of blocking in
+// send_sync, so a slow disk does not tie up the pool.
+static multimap<uint64_t, Connection*> parked;
+static pthread_mutex_t parked_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void enqueue_ready(Connection* conn)
+{
+    pthread_mutex_lock(&queue_mutex);
+    ready_queue.push_back(conn);
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_mutex);
+}
+
+static Connection* dequeue_ready()
+{
+    pthread_mutex_lock(&queue_mutex);
+    while (ready_queue.empty()) {
+        pthread_cond_wait(&queue_cond, &queue_mutex);
+    }
+    Connection* conn = ready_queue.front();
+    ready_queue.pop_front();
+    pthread_mutex_unlock(&queue_mutex);
+    return conn;
+}
+
+// Parks conn until the WAL is durable up to its replies' LSN. False if it
+// already is.
+static bool park_until_durable(Connection* conn)
+{
+    uint64_t lsn = conn->session.reply_lsn;
+    pthread_mutex_lock(&parked_mutex);
+    // checked under parked_mutex, which release_durable() takes only after
+    // the durable LSN moved, so a wakeup cannot be missed
+    bool wait = lsn > wal_durable_lsn();
+    if (wait) parked.emplace(lsn, conn);
+    pthread_mutex_unlock(&parked_mutex);
+    return wait;
+}
+
+// WAL writer callback: hands connections whose records are now durable back
+// to the workers, which send the held replies (service_connection).
+static void release_durable(uint64_t durable_lsn)
+{
+    vector<Connection*> ready;
+    pthread_mutex_lock(&parked_mutex);
+    auto end = parked.upper_bound(durable_lsn);
+    for (auto it = parked.begin(); it != end; ++it) ready.push_back(it->second);
+    parked.erase(parked.begin(), end);
+    pthread_mutex_unlock(&parked_mutex);
+    for (Connection* conn : ready) enqueue_ready(conn);
+}
+
+static void teardown(Connection* conn)
+{
+    poller.remove(conn->session.fd);
+    end_client_session(conn->session);
+    session_closed();
+    close(conn->session.fd);
+    delete conn;
+}
+
+// Reads everything currently available. Returns false on EOF or error.
+static bool fill_input(Connection* conn)
+{
+    char buff[16384];
+    while (1) {
+        ssize_t r = recv(conn->session.fd, buff, sizeof(buff), 0);
+        if (r > 0) {
+            conn->inbuf.append(buff, r);
+            continue;
+        }
+        if (r == 0) return false;
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+        perror("recv");
+        return false;
+    }
+}
+
+// Writes as much of outbuf as the socket accepts. Returns false on error.
+static bool flush_output(Connection* conn)
+{
+    size_t sent = 0;
+    while (sent < conn->outbuf.size()) {
+        ssize_t n = send(conn->session.fd, conn->outbuf.data() + sent, conn->outbuf.size() - sent, 0);
+        if (n > 0) {
+            sent += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        return false;
+    }
+    conn->outbuf.erase(0, sent);
+    return true;
+}
+
+static void service_connection(Connection* conn)
+{
+    // a previous reply was only partially written, or held until its WAL
+    // records were durable; finish it before reading more
+    if (!conn->outbuf.empty()) {
+        if (!flush_output(conn)) {
+            teardown(conn);
+            return;
+        }
+        if (!conn->outbuf.empty()) {
+            poller.rearm(conn->session.fd, conn, true);
+            return;
+        }
+    }
+
+    if (!fill_input(conn)) {
+        conn->closed = true;
+    }
+
+    if (!process_client_input(conn->session, conn->inbuf, conn->outbuf)) {
+        conn->closed = true;
+    }
+
+    // comes back through the ready queue with the replies still in outbuf
+    if (park_until_durable(conn)) return;
+
+    if (!flush_output(conn) || conn->closed) {
+        teardown(conn);
+        return;
+    }
+    poller.rearm(conn->session.fd, conn, !conn->outbuf.empty());
+}
+
+static void* reactor_worker(void* arg)
+{
+    while (1) {
+        service_connection(dequeue_ready());
+    }
+    return nullptr;
+}
+
+static void accept_clients()
+{
+    while (1) {
+        int client_fd = accept(listen_fd, nullptr, nullptr);
+        if (client_fd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+            break;
+        }
+        set_nonblocking(client_fd);
+
+        Connection* conn = new Connection();
+        conn->session.fd = client_fd;
+        conn->session.client_ip = peer_ip_of(client_fd);
+        conn->session.defer_durable = true;
+        // counted before a worker can see (and tear down) the connection
+        session_opened();
+        if (!poller.add(client_fd, conn)) {
+            perror("poller add");
+            session_closed();
+            close(client_fd);
+            delete conn;
+        }
+    }
+    poller.rearm(listen_fd, &listen_tag, false);
+}
+
+void run_reactor(int server_fd, int num_workers)
+{
+    if (!poller.ok()) {
+        perror("poller");
+        return;
+    }
+    listen_fd = server_fd;
+    set_nonblocking(listen_fd);
+    if (!poller.add(listen_fd, &listen_tag)) {
+        perror("poller add");
+        return;
+    }
+
+    set_wal_durable_callback(release_durable);
+    if (num_workers < 1) num_workers = 1;
+    for (int i = 0; i < num_workers; ++i) {
+        pthread_t id;
+        pthread_create(&id, nullptr, reactor_worker, nullptr);
+        pthread_detach(id);
+    }
+    cout << "[REACTOR] Serving clients with " << num_workers << " worker threads" << endl;
+
+    PollEvent events[128];
+    while (1) {
+        int n = poller.wait(events, 128, -1);
+        if (n < 0) {
+            perror("poller wait");
+            continue;
+        }
+        for (int i = 0; i < n; ++i) {
+            if (events[i].data == &listen_tag) {
+                accept_clients();
+            } else {
+                enqueue_ready((Connection*)events[i].data);
+            }
+        }
+    }
+}
@@ -0,0 +1,10 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+// Event-driven client port: one thread waits for readiness on every client
+// socket and hands ready connections to a fixed pool of worker threads that
+// run the command functions from details.cpp. Replies to mutations are held
+// until the WAL has fsynced them, without blocking a worker meanwhile.
+void run_reactor(int server_fd, int num_workers);
+
+#endif
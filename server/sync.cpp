@@ -1,5 +1,11 @@
+#include <algorithm>
 #include <cstddef>
 #include <cstdio>
+#include <cerrno>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
 #include<iostream>
 #include <pthread.h>
 #include<sstream>
@@ -9,12 +15,16 @@
 #include<vector>
 #include<unistd.h>
 #include<fcntl.h>
+#include<poll.h>
 #include<sys/socket.h>
 #include<arpa/inet.h>
 #include<netinet/in.h>
 
 #include "details.h"
+#include "liveness.h"
+#include "persist.h"
 #include "sync.h"
+#include "../common/protocol.h"
 
 using namespace std;
 
@@ -27,10 +37,75 @@ struct Tracker
 
 static vector<Tracker>g_trackers;
 static pthread_mutex_t sync_mutex=PTHREAD_MUTEX_INITIALIZER;
-static int peer_fd_in=-1;
-static int peer_fd_out=-1;
 static int self_id=-1;
 
+// --- Replication log ---
+// Every local mutation gets the next sequence number of this tracker's
+// epoch and is kept in a bounded in-memory log. Each other tracker in
+// tracker_info.txt has its own connection, cursor and sync_sender() thread
+// streaming the log from that cursor (a full mesh: every tracker sends its
+// own mutations straight to all the others). A reconnecting peer reports
+// the last sequence it applied and gets only what it missed, or the full
+// state if that part of the log has already been evicted.
+//
+// Peer stream, on the connection this tracker opens:
+//   -> HELLO <tracker id> <epoch>
+//   <- RESUME <epoch> <last seq>     what the peer has applied from us
+//   -> FULL <epoch> <seq>            only if the log cannot cover the gap,
+//   -> 0 SYNC|...                    followed by the whole state,
+//   -> ORIGIN <id> <epoch> <seq>     what it covers from each other tracker
+//   -> END <epoch> <seq>             and the end of it
+//   -> <seq> SYNC|...                log entries after the cursor
+static const size_t SYNC_LOG_MAX_BYTES=16*1024*1024;
+static const size_t SYNC_BATCH_MAX_BYTES=256*1024;
+// a peer that cannot take a write (or answer HELLO) for this long is treated as dead
+static const int SYNC_SEND_TIMEOUT_SEC=5;
+
+struct LogEntry
+{
+    uint64_t seq;
+    string line;        // "<seq> SYNC|...\n"
+    chrono::steady_clock::time_point enqueued;
+};
+
+static uint64_t sync_epoch=0;
+static deque<LogEntry> sync_log;
+static size_t sync_log_bytes=0;
+static uint64_t last_seq=0;
+static pthread_mutex_t queue_mutex=PTHREAD_MUTEX_INITIALIZER;
+// broadcast on new entries and when a peer becomes ready
+static pthread_cond_t queue_nonempty=PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queue_space=PTHREAD_COND_INITIALIZER;
+static SyncQueueStats queue_stats;
+
+// One other tracker we replicate to.
+struct Peer
+{
+    int id;
+    // outgoing connection, under sync_mutex
+    int fd_out=-1;
+    // signalled when fd_out is dropped so sync_accept reconnects
+    pthread_cond_t out_closed=PTHREAD_COND_INITIALIZER;
+    // the rest is under queue_mutex
+    uint64_t cursor=0;       // last sequence written; only meaningful while attached
+    bool attached=false;     // cursor is known; holds back trimming of unsent entries
+    bool ready=false;        // full transfer (if any) done; sync_sender() may stream
+};
+// built by start_sync() and never resized afterwards
+static vector<Peer*> peers;
+
+// What this tracker has applied from the peer, by the peer's tracker id.
+struct OriginState
+{
+    uint64_t epoch=0;
+    uint64_t last_seq=0;
+};
+static map<int,OriginState> origins;
+// The connection each peer's stream is currently read from, by tracker id.
+// Lines from any other connection of that peer are dropped. Both maps are
+// under sync_mutex.
+static map<int,int> incoming;
+
 static void read_input(const string& file)
 {
     g_trackers.clear();
@@ -40,19 +115,17 @@ static void read_input(const string& file)
         perror("open");
         return;
     }
+    // any number of trackers, one per line
+    string contents;
     char buff[1024];
-    int n=read(fd,buff,sizeof(buff)-1);
-    if(n<=0)
-    {
-        if(n==-1)
-        perror("read");
-        close(fd);
-        return;
-    }
-    buff[n]='\0';
+    ssize_t n;
+    while((n=read(fd,buff,sizeof(buff)))>0)
+    contents.append(buff,n);
+    if(n<0)
+    perror("read");
     close(fd);
 
-    stringstream ss(buff);
+    stringstream ss(contents);
     string line;
     while(getline(ss,line))
     {
@@ -74,32 +147,672 @@ int get_client_port(int trackerId)
     return g_trackers[trackerId].clientPort;
 }
 
-void send_sync(const string& msg)
+static uint64_t micros_since(chrono::steady_clock::time_point t)
+{
+    return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now()-t).count();
+}
+
+// Lowest cursor among the attached peers (attached_only) or all peers;
+// last_seq when there is none. Caller holds queue_mutex.
+static uint64_t min_cursor(bool attached_only)
+{
+    uint64_t lowest=last_seq;
+    for(Peer* peer : peers)
+    {
+        if(!attached_only || peer->attached)
+        lowest=min(lowest,peer->cursor);
+    }
+    return lowest;
+}
+
+// Heartbeats and piece announcements (have_pieces) are replicated but
+// never logged: live clients re-send them every few seconds, liveness starts
+// over after a restart anyway, and they would dominate the WAL.
+static bool is_soft_state(const string& msg)
+{
+    return msg.compare(0,15,"SYNC|heartbeat|")==0 || msg.compare(0,17,"SYNC|have_pieces|")==0;
+}
+
+uint64_t send_sync(const string& msg,bool wait_durable)
+{
+    // the mutation is logged locally before it is replicated; peers may
+    // still apply it before it is durable here when the caller does not wait
+    uint64_t lsn=0;
+    if(!is_soft_state(msg))
+    lsn=wal_append(msg,wait_durable);
+
+    size_t len=msg.size();
+    if(len>0 && msg[len-1]=='\n')
+    len--;
+
+    pthread_mutex_lock(&queue_mutex);
+    // Make room. Entries every attached peer already has can go, and so can
+    // anything a detached peer is missing (it will need a full transfer);
+    // entries an attached peer has not received yet hold the caller instead.
+    size_t need=len+24;
+    bool waited=false;
+    while(sync_log_bytes+need>SYNC_LOG_MAX_BYTES && !sync_log.empty())
+    {
+        if(sync_log.front().seq>min_cursor(true))
+        {
+            waited=true;
+            pthread_cond_wait(&queue_space,&queue_mutex);
+            continue;
+        }
+        if(sync_log.front().seq>min_cursor(false))
+        queue_stats.evicted++;
+        sync_log_bytes-=sync_log.front().line.size();
+        sync_log.pop_front();
+    }
+    if(waited)
+    queue_stats.backpressure_waits++;
+
+    LogEntry entry;
+    entry.seq=++last_seq;
+    entry.line=to_string(entry.seq);
+    entry.line+=' ';
+    entry.line.append(msg,0,len);
+    entry.line+='\n';
+    entry.enqueued=chrono::steady_clock::now();
+    sync_log_bytes+=entry.line.size();
+    sync_log.push_back(move(entry));
+    queue_stats.enqueued++;
+    pthread_cond_broadcast(&queue_nonempty);
+    pthread_mutex_unlock(&queue_mutex);
+    return lsn;
+}
+
+// Index in sync_log of the first entry after seq. Caller holds queue_mutex.
+static size_t log_index_after(uint64_t seq)
+{
+    if(sync_log.empty() || seq<sync_log.front().seq)
+    return 0;
+    return min((size_t)(seq+1-sync_log.front().seq),sync_log.size());
+}
+
+SyncQueueStats get_sync_queue_stats()
+{
+    pthread_mutex_lock(&queue_mutex);
+    SyncQueueStats st=queue_stats;
+    // backlog of the slowest peer
+    size_t first=log_index_after(min_cursor(false));
+    st.depth=sync_log.size()-first;
+    for(size_t i=first;i<sync_log.size();++i)
+    st.bytes+=sync_log[i].line.size();
+    st.oldest_age_us=first<sync_log.size() ? micros_since(sync_log[first].enqueued) : 0;
+    st.log_entries=sync_log.size();
+    st.log_bytes=sync_log_bytes;
+    st.last_seq=last_seq;
+    for(Peer* peer : peers)
+    {
+        if(peer->ready)
+        st.peers_connected++;
+    }
+    st.peers=peers.size();
+    pthread_mutex_unlock(&queue_mutex);
+    return st;
+}
+
+static bool send_all(int fd,const char* data,size_t len)
+{
+    size_t sent=0;
+    while(sent<len)
+    {
+        ssize_t n=send(fd,data+sent,len-sent,0);
+        if(n<0 && errno==EINTR)
+        continue;
+        if(n<=0)
+        return false;
+        sent+=n;
+    }
+    return true;
+}
+
+// Closes the outgoing connection to peer (if fd is still current) and
+// detaches it so the log may be trimmed again; sync_accept() then redials.
+static void drop_outgoing(Peer* peer,int fd)
+{
+    pthread_mutex_lock(&sync_mutex);
+    if(peer->fd_out==fd)
+    {
+        close(peer->fd_out);
+        peer->fd_out=-1;
+        pthread_cond_broadcast(&peer->out_closed);
+    }
+    pthread_mutex_unlock(&sync_mutex);
+
+    pthread_mutex_lock(&queue_mutex);
+    peer->attached=false;
+    peer->ready=false;
+    pthread_cond_broadcast(&queue_space);
+    pthread_mutex_unlock(&queue_mutex);
+}
+
+static void* sync_sender(void* arg)
+{
+    Peer* peer=(Peer*)arg;
+    string batch;
+    while(1)
+    {
+        pthread_mutex_lock(&queue_mutex);
+        while(!peer->ready || peer->cursor>=last_seq)
+        pthread_cond_wait(&queue_nonempty,&queue_mutex);
+
+        // an attached peer's unsent entries are never evicted, so the log
+        // holds everything after its cursor
+        batch.clear();
+        size_t count=0;
+        uint64_t from=peer->cursor;
+        size_t i=log_index_after(from);
+        chrono::steady_clock::time_point oldest=sync_log[i].enqueued;
+        while(i<sync_log.size() && (batch.empty() || batch.size()+sync_log[i].line.size()<=SYNC_BATCH_MAX_BYTES))
+        {
+            batch+=sync_log[i].line;
+            i++;
+            count++;
+        }
+        uint64_t to=from+count;
+        pthread_mutex_unlock(&queue_mutex);
+
+        // Only outgoing connections carry replication traffic: a peer reads
+        // the sockets it accepted and never reads the ones it opened.
+        pthread_mutex_lock(&sync_mutex);
+        int fd=peer->fd_out;
+        pthread_mutex_unlock(&sync_mutex);
+
+        if(fd==-1 || !send_all(fd,batch.data(),batch.size()))
+        {
+            cerr<<"[SYNC] Failed to send to tracker "<<peer->id<<"\n";
+            drop_outgoing(peer,fd);
+            continue;
+        }
+
+        pthread_mutex_lock(&queue_mutex);
+        // a reconnect in the meantime re-seeds the cursor from the peer
+        if(peer->ready && peer->cursor==from)
+        peer->cursor=to;
+        queue_stats.sent+=count;
+        queue_stats.batches++;
+        queue_stats.last_batch_msgs=count;
+        queue_stats.last_lag_us=micros_since(oldest);
+        pthread_cond_broadcast(&queue_space);
+        pthread_mutex_unlock(&queue_mutex);
+    }
+    return nullptr;
+}
+
+// Splits a "SYNC|a|b|...|" line into its '|' separated fields.
+static void split_fields(string_view line,vector<string_view>& fields)
+{
+    fields.clear();
+    size_t start=0;
+    while(start<line.size())
+    {
+        size_t bar=line.find('|',start);
+        if(bar==string_view::npos)
+        {
+            fields.push_back(line.substr(start));
+            break;
+        }
+        fields.push_back(line.substr(start,bar-start));
+        start=bar+1;
+    }
+}
+
+void apply_sync_message(const string& command)
+{
+    // reused per thread: snapshot replay calls this millions of times
+    static thread_local vector<string_view> f;
+    split_fields(command,f);
+    // f[0] is the tag, f[1] the operation; missing fields read as empty
+    auto field=[&](size_t i) { return i<f.size() ? string(f[i]) : string(); };
+    if(field(0)!="SYNC")
+    return;
+    string txt=field(1);
+
+    if(txt=="create_user")
+    {
+        create_user(field(2),field(3));
+    }
+    else if(txt=="create_group")
+    {
+        create_group(field(2),field(3));
+    }
+    else if(txt=="join_group")
+    {
+        join_group(field(2),field(3));
+    }
+    else if(txt=="leave_group")
+    {
+        leave_group(field(2),field(3));
+    }
+    else if(txt=="accept_request")
+    {
+        string groupId=field(2),userId=field(3);
+        string ownerId = group_owner(groupId);
+
+        if (!ownerId.empty()) {
+            accept_request(groupId, userId, ownerId);
+        }
+        else {
+        cerr<<"[SYNC] unknown command: "<<txt<<"\n";
+        }
+    }
+    else if(txt=="login" || txt=="heartbeat") {
+        // under replace_state the caller re-arms every address afterwards
+        // (live_mutex is taken before addrs_lock, never after)
+        if(holding_all_state_locks)
+        set_client_address(field(2), field(3));
+        else
+        refresh_client(field(2), field(3));
+        // login|user|addr|token|
+        if(txt=="login" && !field(4).empty())
+        set_session_token(field(2), field(4));
+    }
+    else if(txt=="session") {
+        // session|user|token|: token of a user with no live address (snapshots)
+        set_session_token(field(2), field(3));
+    }
+    else if(txt=="logout") {
+        logout(field(2));
+        if(!holding_all_state_locks)
+        forget_client(field(2));
+        // logout|user|revoke| for an explicit logout, not a dropped connection
+        if(field(3)=="revoke")
+        revoke_session_token(field(2));
+    }
+    else if(txt=="upload_file" || txt=="restore_file") {
+        // upload_file|group|file|size|sha1|n|hashes...|SEEDERS|ids...|[PARTIAL|id|hexbits|...]
+        // restore_file carries the owner after sha1 and bypasses the
+        // membership check (snapshots, where the record already exists)
+        size_t i=2;
+        string group=field(i++), file=field(i++), size=field(i++), sha1=field(i++);
+        string owner = txt=="restore_file" ? field(i++) : string();
+        uint64_t numPieces=0, fileSize=0;
+        if(!parse_number(field(i++), numPieces) || !parse_number(size, fileSize) || numPieces>f.size()) {
+            cerr<<"[SYNC] malformed "<<txt<<" for "<<file<<"\n";
+            return;
+        }
+
+        string piece_digests;
+        piece_digests.reserve(numPieces*DIGEST_BYTES);
+        for(uint64_t p=0; p<numPieces; ++p) {
+            if(i>=f.size() || !append_digest_from_hex(piece_digests, f[i++])) {
+                cerr<<"[SYNC] malformed piece hash for "<<file<<"\n";
+                return;
+            }
+        }
+
+        i++; // SEEDERS tag
+        vector<string> seeders;
+        for(; i<f.size() && f[i]!="PARTIAL"; ++i) {
+            if(!f[i].empty())
+                seeders.emplace_back(f[i]);
+        }
+        vector<pair<string,string>> partial;
+        for(i++; i+1<f.size(); i+=2) {
+            string bits;
+            if(!f[i].empty() && append_bytes_from_hex(bits, f[i+1]))
+                partial.emplace_back(string(f[i]), move(bits));
+        }
+        if(txt=="restore_file") {
+            restore_file(group, file, fileSize, sha1, piece_digests, owner, seeders, partial);
+        } else {
+            for(const auto& seeder : seeders)
+                upload_file(group, file, fileSize, sha1, piece_digests, seeder);
+        }
+    }
+    else if(txt=="restore_group") {
+        // restore_group|group|owner|MEMBERS|ids...|PENDING|ids...|
+        vector<string> members, pending;
+        vector<string>* into=nullptr;
+        for(size_t i=4; i<f.size(); ++i) {
+            if(f[i]=="MEMBERS") into=&members;
+            else if(f[i]=="PENDING") into=&pending;
+            else if(into && !f[i].empty()) into->emplace_back(f[i]);
+        }
+        restore_group(field(2), field(3), members, pending);
+    }
+    else if(txt=="stop_share") {
+        stop_share(field(2), field(3), field(4));
+    }
+    else if(txt=="have_pieces") {
+        // have_pieces|group|file|user|hexbits|
+        string bits;
+        if(append_bytes_from_hex(bits, f.size()>5 ? f[5] : string_view()))
+            have_pieces(field(2), field(3), field(4), bits);
+    }
+    else if(txt=="reset") {
+        // reset||: WAL only, written ahead of a full transfer that replaced
+        // the whole state (replace_with_full_state)
+        replace_state([] {});
+    }
+}
+
+void dump_state_as_sync(const function<void(const string&)>& emit)
+{
+    string line;
+    {
+        ReadLock lock(&users_lock);
+        for(const auto& u : userDetails)
+        emit("SYNC|create_user|"+u.first+"|"+u.second+"|");
+    }
+    {
+        ReadLock lock(&groups_lock);
+        for(const auto& g : groupDetails)
+        {
+            line="SYNC|restore_group|"+g.first+"|"+g.second.owner+"|MEMBERS|";
+            for(const auto& m : g.second.members)
+            line+=m+"|";
+            line+="PENDING|";
+            for(const auto& p : g.second.pendRequests)
+            line+=p+"|";
+            emit(line);
+        }
+    }
+    {
+        ReadLock lock(&files_lock);
+        for(const auto& entry : fileDetails)
+        {
+            const FileInfo& info=entry.second;
+            line="SYNC|restore_file|"+info.group_id+"|"+info.filename+"|"+to_string(info.file_size)+"|"
+                +info.whole_file_sha1+"|"+info.owner_id+"|"+to_string(info.num_pieces())+"|";
+            append_digests_hex(line,info.piece_digests,'|');
+            line+="SEEDERS|";
+            for(const auto& seeder : info.seeders)
+            line+=seeder+"|";
+            if(!info.partial.empty())
+            {
+                line+="PARTIAL|";
+                for(const auto& holder : info.partial)
+                {
+                    line+=holder.first+"|";
+                    append_hex(line,holder.second);
+                    line+="|";
+                }
+            }
+            emit(line);
+        }
+    }
+    {
+        ReadLock lock(&users_lock);
+        for(const auto& t : session_tokens)
+        emit("SYNC|session|"+t.first+"|"+t.second+"|");
+    }
+    {
+        ReadLock lock(&addrs_lock);
+        for(const auto& a : client_addresses)
+        emit("SYNC|login|"+a.first+"|"+a.second+"|");
+    }
+}
+
+// State of one peer's outgoing connection, as seen by its reader.
+struct PeerStream
+{
+    int origin=-1;              // the peer's tracker id, learned from its HELLO
+    bool replacing=false;       // inside a full transfer that replaces our state
+    vector<string> full_state;  // its records, applied once END arrives
+    map<int,OriginState> views; // its ORIGIN lines for that transfer
+    bool refused=false;         // an old-format peer, already reported
+};
+
+// Swaps our state for a peer's full transfer. Our own log entries not yet
+// written to that peer cannot be in its dump, so they are applied again on
+// top. The WAL gets a reset record and the new state in one batch, so
+// recovery rebuilds the same thing.
+static void replace_with_full_state(int origin,const vector<string>& full_state)
+{
+    vector<string> own;
+    pthread_mutex_lock(&queue_mutex);
+    uint64_t written=0;
+    for(Peer* peer : peers)
+    {
+        if(peer->id==origin)
+        written=peer->cursor;
+    }
+    for(size_t i=log_index_after(written);i<sync_log.size();++i)
+    {
+        // "<seq> SYNC|...\n"
+        const string& line=sync_log[i].line;
+        size_t sp=line.find(' ');
+        own.emplace_back(line,sp+1,line.size()-sp-2);
+    }
+    pthread_mutex_unlock(&queue_mutex);
+
+    replace_state([&] {
+        for(const auto& command : full_state)
+        apply_sync_message(command);
+        for(const auto& command : own)
+        apply_sync_message(command);
+    });
+
+    // logins applied above could not touch the liveness wheel
+    vector<string> users;
+    {
+        ReadLock lock(&addrs_lock);
+        for(const auto& a : client_addresses)
+        users.push_back(a.first);
+    }
+    for(const auto& user : users)
+    touch_client(user);
+
+    vector<string> records;
+    records.reserve(1+full_state.size()+own.size());
+    records.emplace_back("SYNC|reset|");
+    for(const auto& command : full_state)
+    {
+        if(!is_soft_state(command))
+        records.push_back(command);
+    }
+    for(const auto& command : own)
+    {
+        if(!is_soft_state(command))
+        records.push_back(command);
+    }
+    wal_append_all(records,false);
+}
+
+// After a replace we hold exactly the sender's state, so what we have
+// applied from each other tracker is what the sender had (its ORIGIN lines).
+// Where we had more, that tracker's stream is cut: it redials on its next
+// send and resends from the cursor we now report, so the records the
+// replace dropped come back.
+static void adopt_origin_views(const PeerStream& stream)
 {
     pthread_mutex_lock(&sync_mutex);
-    string new_msg=msg;
-    if(new_msg.empty() || new_msg.back()!='\n')
-    new_msg.push_back('\n');
+    for(int id=0;id<(int)g_trackers.size();id++)
+    {
+        if(id==self_id || id==stream.origin)
+        continue;
+        OriginState& ours=origins[id];
+        auto view=stream.views.find(id);
+        OriginState theirs=view==stream.views.end() ? OriginState() : view->second;
+        bool ahead;
+        if(theirs.epoch==ours.epoch)
+        {
+            ahead=ours.last_seq>theirs.last_seq;
+            ours=theirs;
+        }
+        else if(theirs.epoch<ours.epoch)
+        {
+            // the sender has nothing from that tracker's current run
+            ahead=ours.last_seq>0;
+            ours.last_seq=0;
+        }
+        else
+        {
+            // a later run we have not heard from; our stream is stale
+            ahead=true;
+            ours=theirs;
+        }
+        if(!ahead)
+        continue;
+        auto conn=incoming.find(id);
+        if(conn!=incoming.end())
+        {
+            shutdown(conn->second,SHUT_RDWR);
+            incoming.erase(conn);
+            cout<<"[SYNC] Rewound tracker "<<id<<" to seq "<<ours.last_seq<<" after the full state from "<<stream.origin<<endl;
+        }
+    }
+    pthread_mutex_unlock(&sync_mutex);
+}
+
+// Handles one line from a peer's outgoing connection (see the stream
+// description at the top of this file).
+static void handle_peer_line(int conn,PeerStream& stream,const string& line)
+{
+    if(line.compare(0,5,"SYNC|")==0)
+    {
+        // A tracker from before sequence numbers. Its records (upload_file
+        // without piece counts, for one) no longer parse, so it is refused
+        // rather than half applied.
+        if(!stream.refused)
+        cerr<<"[SYNC] Ignoring a peer without sequence numbers; upgrade every tracker together\n";
+        stream.refused=true;
+        return;
+    }
 
-    if(peer_fd_in!=-1)
+    size_t sp=line.find(' ');
+    if(sp==string::npos)
+    return;
+    string_view head(line.data(),sp);
+    if(head=="ORIGIN")
     {
-        ssize_t n=send(peer_fd_in,new_msg.c_str(),new_msg.size(),0);
-        if(n<=0){
-        cerr<<"[SYNC] Failed to send (incoming)\n";
-        close(peer_fd_in);
-        peer_fd_in=-1;
+        unsigned long long id=0,a=0,b=0;
+        if(sscanf(line.c_str()+sp+1,"%llu %llu %llu",&id,&a,&b)!=3)
+        {
+            cerr<<"[SYNC] malformed peer line: "<<line<<"\n";
+            return;
         }
+        if(stream.replacing)
+        stream.views[(int)id]={a,b};
+        return;
     }
-    if(peer_fd_out!=-1)
+    if(head=="HELLO" || head=="FULL" || head=="END")
     {
-        ssize_t n=send(peer_fd_out,new_msg.c_str(),new_msg.size(),0);
-        if(n<=0){
-        cerr<<"[SYNC] Failed to send (outgoing)\n";
-        close(peer_fd_out);
-        peer_fd_out=-1;
+        unsigned long long a=0,b=0;
+        if(sscanf(line.c_str()+sp+1,"%llu %llu",&a,&b)!=2)
+        {
+            cerr<<"[SYNC] malformed peer line: "<<line<<"\n";
+            return;
         }
+        if(head=="HELLO")
+        {
+            if(a>=g_trackers.size() || (int)a==self_id)
+            {
+                cerr<<"[SYNC] HELLO from unknown tracker "<<a<<"\n";
+                return;
+            }
+            stream.origin=(int)a;
+            pthread_mutex_lock(&sync_mutex);
+            incoming[stream.origin]=conn;
+            OriginState st=origins[stream.origin];
+            pthread_mutex_unlock(&sync_mutex);
+            // the peer compares the epoch: after a restart it numbers from 1 again
+            string reply="RESUME "+to_string(st.epoch)+" "+to_string(st.last_seq)+"\n";
+            send_all(conn,reply.data(),reply.size());
+        }
+        else if(head=="FULL")
+        {
+            // The transfer replaces our state, so whatever the peer deleted
+            // while we were out of reach is gone here too. That needs the
+            // peer's state to be the newer one: either we fell behind this
+            // same run of it, or we are a later process (epochs are start
+            // times) that has not heard from it yet and only has what it
+            // recovered from disk. Otherwise records are merged as they
+            // arrive, as a restarted peer's would be (it sends none, see
+            // handshake_peer, unless its log no longer reaches back).
+            pthread_mutex_lock(&sync_mutex);
+            uint64_t known=origins[stream.origin].epoch;
+            pthread_mutex_unlock(&sync_mutex);
+            stream.replacing=known==a || (known==0 && a<sync_epoch);
+            stream.full_state.clear();
+            stream.views.clear();
+            cout<<"[SYNC] Receiving full state from peer "<<stream.origin<<" at seq "<<b
+                <<(stream.replacing ? ", replacing ours" : ", merging it into ours")<<endl;
+        }
+        else
+        {
+            if(stream.replacing)
+            {
+                replace_with_full_state(stream.origin,stream.full_state);
+                adopt_origin_views(stream);
+                stream.replacing=false;
+                stream.full_state.clear();
+                stream.full_state.shrink_to_fit();
+            }
+            // everything up to seq b is in now; a transfer cut short before
+            // END leaves this unchanged, so the next handshake sends it again
+            pthread_mutex_lock(&sync_mutex);
+            if(incoming[stream.origin]==conn)
+            origins[stream.origin]={a,b};
+            pthread_mutex_unlock(&sync_mutex);
+            cout<<"[SYNC] Applied full state from peer "<<stream.origin<<endl;
+        }
+        return;
     }
-     pthread_mutex_unlock(&sync_mutex);
+
+    uint64_t seq=0;
+    if(!parse_number(head,seq))
+    return;
+    if(seq!=0)
+    {
+        pthread_mutex_lock(&sync_mutex);
+        OriginState& st=origins[stream.origin];
+        // a stream cut by adopt_origin_views() must not move the cursor
+        bool fresh=incoming[stream.origin]==conn && seq>st.last_seq;
+        if(fresh)
+        st.last_seq=seq;
+        pthread_mutex_unlock(&sync_mutex);
+        // already applied before a reconnect
+        if(!fresh)
+        return;
+    }
+    else if(stream.replacing)
+    {
+        stream.full_state.push_back(line.substr(sp+1));
+        return;
+    }
+    string command=line.substr(sp+1);
+    apply_sync_message(command);
+    if(!is_soft_state(command))
+    wal_append(command,false);
+}
+
+// Applies the stream from one peer's outgoing connection until it closes.
+static void* sync_receive(void* arg)
+{
+    int conn=(int)(intptr_t)arg;
+    string rem;
+    char buff[16384];
+    PeerStream stream;
+    while(1)
+    {
+        ssize_t r=recv(conn,buff,sizeof(buff),0);
+        if(r<=0)
+        break;
+        rem.append(buff,r);
+
+        size_t start=0,pos;
+        while((pos=rem.find('\n',start))!=string::npos)
+        {
+            string command=rem.substr(start,pos-start);
+            start=pos+1;
+            if(command.empty())
+            continue;
+            handle_peer_line(conn,stream,command);
+        }
+        rem.erase(0,start);
+    }
+    cout<<"[SYNC] incoming connection from tracker "<<stream.origin<<" closed"<<endl;
+    pthread_mutex_lock(&sync_mutex);
+    auto current=incoming.find(stream.origin);
+    if(current!=incoming.end() && current->second==conn)
+    incoming.erase(current);
+    pthread_mutex_unlock(&sync_mutex);
+    close(conn);
+    return nullptr;
 }
 
 static void* sync_listen(void* arg)
@@ -128,7 +841,7 @@ static void* sync_listen(void* arg)
         return nullptr;
     }
 
-    if(listen(server_fd,5)<0)
+    if(listen(server_fd,SOMAXCONN)<0)
     {
         perror("listen");
         close(server_fd);
@@ -149,150 +862,123 @@ static void* sync_listen(void* arg)
 
         cout<<"[SYNC] Connection established (incoming) "<<endl;
 
-        pthread_mutex_lock(&sync_mutex);
-        if(peer_fd_in!=-1 && peer_fd_in!=conn)
+        // one reader per peer: each tracker opens its own connection to us
+        pthread_t reader;
+        if(pthread_create(&reader,nullptr,sync_receive,(void*)(intptr_t)conn)!=0)
         {
-            close(peer_fd_in);
+            perror("pthread_create");
+            close(conn);
+            continue;
         }
-        peer_fd_in=conn;
-        pthread_mutex_unlock(&sync_mutex);
-
-        string rem;
-        char buff[1024];
-        while(1)
-        {
-            ssize_t r=recv(conn,buff,sizeof(buff)-1,0);
-            if(r<=0)
-            {
-                cout<<"[SYNC] incoming connection closed"<<endl;
-                close(conn);
-                pthread_mutex_lock(&sync_mutex);
-                peer_fd_in=-1;
-                pthread_mutex_unlock(&sync_mutex);
-                break;
-            }
-            buff[r]='\0';
-            rem.append(buff,r);
+        pthread_detach(reader);
+    }
+    close(server_fd);
+    return nullptr;
+}
 
-            size_t pos;
-            while((pos=rem.find('\n'))!=string::npos)
-            {
-                string command=rem.substr(0,pos);
-                rem.erase(0,pos+1);
-                if(command.empty())
-                continue;
+// Reads one '\n' terminated line from fd (the peer's RESUME reply).
+static bool recv_line(int fd,string& line)
+{
+    line.clear();
+    char c;
+    while(line.size()<256)
+    {
+        ssize_t n=recv(fd,&c,1,0);
+        if(n<0 && errno==EINTR)
+        continue;
+        if(n<=0)
+        return false;
+        if(c=='\n')
+        return true;
+        line+=c;
+    }
+    return false;
+}
 
-                stringstream ss(command);
-                string tag,txt;
-                getline(ss,tag,'|');
-                if(tag!="SYNC")
-                continue;
-                getline(ss,txt,'|');
-                if(txt=="create_user")
-                {
-                    string user,password;
-                    getline(ss,user,'|');
-                    getline(ss,password,'|');
-                    create_user(user,password);
-                }
-                else if(txt=="create_group")
-                {
-                    string groupId,userId;
-                    getline(ss,groupId,'|');
-                    getline(ss,userId,'|');
-                    create_group(groupId,userId);
-                }
-                else if(txt=="join_group")
-                {
-                    string groupId,userId;
-                    getline(ss,groupId,'|');
-                    getline(ss,userId,'|');
-                    join_group(groupId,userId);
-                }
-                else if(txt=="leave_group")
-                {
-                    string groupId,userId;
-                    getline(ss,groupId,'|');
-                    getline(ss,userId,'|');
-                    leave_group(groupId,userId);
-                }
-                else if(txt=="accept_request")
-                {
-                    string groupId,userId;
-                    getline(ss,groupId,'|');
-                    getline(ss,userId,'|');
-                    pthread_mutex_lock(&state_mutex);
-                    string ownerId = groupDetails.count(groupId) ? groupDetails[groupId].owner : "";
-                    pthread_mutex_unlock(&state_mutex);
-
-                    if (!ownerId.empty()) {
-                        accept_request(groupId, userId, ownerId);
-                    }
-                    else {
-                    cerr<<"[SYNC] unknown command: "<<txt<<"\n";
-                    }
-                }
+// Runs the HELLO/RESUME exchange on a fresh outgoing connection and
+// positions the peer's cursor, sending the full state first when the log
+// no longer reaches back to what the peer has.
+static bool handshake_peer(Peer* peer,int fd)
+{
+    string hello="HELLO "+to_string(self_id)+" "+to_string(sync_epoch)+"\n";
+    string reply;
+    unsigned long long epoch=0,have=0;
+    if(!send_all(fd,hello.data(),hello.size()) || !recv_line(fd,reply)
+       || sscanf(reply.c_str(),"RESUME %llu %llu",&epoch,&have)!=2)
+    {
+        cerr<<"[SYNC] Handshake with tracker "<<peer->id<<" failed\n";
+        return false;
+    }
 
-                else if(txt=="login") {
-                    string user, addr;
-                    getline(ss, user, '|');
-                    getline(ss, addr, '|');
-                    pthread_mutex_lock(&state_mutex);
-                    client_addresses[user] = addr;
-                    pthread_mutex_unlock(&state_mutex);
-                }
-                else if(txt=="logout") {
-                    string user;
-                    getline(ss, user, '|');
-                    logout(user);
-                }
-                else if(txt=="upload_file") {
-                    string group, file, size, sha1;
-                    getline(ss, group, '|');
-                    getline(ss, file, '|');
-                    getline(ss, size, '|');
-                    getline(ss, sha1, '|');
-
-                    string numPiecesStr;
-                    getline(ss, numPiecesStr, '|');
-                    int numPieces=stoi(numPiecesStr);
-
-                    vector<string> piece_hashes;
-                    for(int i=0; i<numPieces; ++i) {
-                        string ph;
-                        getline(ss, ph, '|');
-                        piece_hashes.push_back(ph);
-                    }
-
-                    string seedersTag;
-                    getline(ss, seedersTag, '|'); 
-                    string seeder;
-                    while(getline(ss, seeder, '|')) {
-                        if(!seeder.empty())
-                            upload_file(group, file, stoul(size), sha1, piece_hashes, seeder);
-                    }
-                }
+    pthread_mutex_lock(&queue_mutex);
+    bool resume=epoch==sync_epoch && have<=last_seq
+        && (have==last_seq || (!sync_log.empty() && sync_log.front().seq<=have+1));
+    // The peer has applied an earlier run of ours, so it is ahead of what
+    // we recovered from disk: send none of that, only what we logged since
+    // we started (while the log still holds all of it), after an empty
+    // full transfer that moves the peer to this epoch.
+    bool restarted=!resume && epoch!=0 && epoch!=sync_epoch
+        && (last_seq==0 || (!sync_log.empty() && sync_log.front().seq==1));
+    if(resume)
+    {
+        queue_stats.resumes++;
+    }
+    else if(restarted)
+    {
+        have=0;
+        queue_stats.full_syncs++;
+    }
+    else
+    {
+        // everything up to last_seq is already applied locally, so the
+        // dump below covers it; replaying later entries over it is harmless
+        have=last_seq;
+        queue_stats.full_syncs++;
+    }
+    peer->cursor=have;
+    peer->attached=true;
+    pthread_mutex_unlock(&queue_mutex);
 
-else if(txt=="stop_share") {
-    string group, file, user;
-    getline(ss, group, '|');
-    getline(ss, file, '|');
-    getline(ss, user, '|');
-    stop_share(group, file, user);
-}
+    if(resume)
+    {
+        cout<<"[SYNC] Resuming tracker "<<peer->id<<" after seq "<<have<<endl;
+        return true;
+    }
+    if(restarted)
+    {
+        cout<<"[SYNC] Tracker "<<peer->id<<" knows an earlier run of ours, sending our log from the start"<<endl;
+        string empty="FULL "+to_string(sync_epoch)+" 0\nEND "+to_string(sync_epoch)+" 0\n";
+        return send_all(fd,empty.data(),empty.size());
+    }
 
-            }
-        }
+    cout<<"[SYNC] Tracker "<<peer->id<<" is too far behind, sending full state at seq "<<have<<endl;
+    // Cursors are read before the dump, so the dump holds at least what
+    // they claim; anything it holds beyond that is resent and reapplied.
+    pthread_mutex_lock(&sync_mutex);
+    map<int,OriginState> views=origins;
+    pthread_mutex_unlock(&sync_mutex);
+    // built up front so the state locks are not held across network writes
+    string full="FULL "+to_string(sync_epoch)+" "+to_string(have)+"\n";
+    dump_state_as_sync([&](const string& line) {
+        full+="0 ";
+        full+=line;
+        full+='\n';
+    });
+    for(const auto& view : views)
+    {
+        if(view.first!=peer->id)
+        full+="ORIGIN "+to_string(view.first)+" "+to_string(view.second.epoch)+" "+to_string(view.second.last_seq)+"\n";
     }
-    close(server_fd);
-    return nullptr;
+    full+="END "+to_string(sync_epoch)+" "+to_string(have)+"\n";
+    return send_all(fd,full.data(),full.size());
 }
 
+// Keeps the outgoing connection to one peer open, redialing when it drops.
 static void* sync_accept(void* arg)
 {
-    int peer_id=1-self_id;
-    string ipAddr=g_trackers[peer_id].ip;
-    int accept_port=g_trackers[peer_id].syncPort;
+    Peer* peer=(Peer*)arg;
+    string ipAddr=g_trackers[peer->id].ip;
+    int accept_port=g_trackers[peer->id].syncPort;
 
     while(1)
     {
@@ -309,12 +995,50 @@ static void* sync_accept(void* arg)
 
         if(connect(sock_fd,(struct sockaddr*)&addr,sizeof(addr))==0)
         {
+            timeval tv{};
+            tv.tv_sec=SYNC_SEND_TIMEOUT_SEC;
+            setsockopt(sock_fd,SOL_SOCKET,SO_SNDTIMEO,&tv,sizeof(tv));
+            setsockopt(sock_fd,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof(tv));
+            cout<<"[SYNC] Connection established (outgoing) to tracker "<<peer->id<<endl;
+
             pthread_mutex_lock(&sync_mutex);
-            peer_fd_out=sock_fd;
+            peer->fd_out=sock_fd;
             pthread_mutex_unlock(&sync_mutex);
-            cout<<"[SYNC] Connection established (outgoing)"<<endl;
-            return nullptr;
+            if(!handshake_peer(peer,sock_fd))
+            {
+                drop_outgoing(peer,sock_fd);
+                sleep(2);
+                continue;
+            }
 
+            pthread_mutex_lock(&queue_mutex);
+            peer->ready=true;
+            pthread_cond_broadcast(&queue_nonempty);
+            pthread_mutex_unlock(&queue_mutex);
+
+            // Sleep until the sender gives up on this connection or the peer
+            // closes it (it writes nothing after RESUME, so readable means
+            // EOF), then redial. An idle sender would not notice the close.
+            pthread_mutex_lock(&sync_mutex);
+            while(peer->fd_out==sock_fd)
+            {
+                timespec deadline;
+                clock_gettime(CLOCK_REALTIME,&deadline);
+                deadline.tv_sec++;
+                pthread_cond_timedwait(&peer->out_closed,&sync_mutex,&deadline);
+                if(peer->fd_out!=sock_fd)
+                break;
+                pollfd pfd{sock_fd,POLLIN,0};
+                if(poll(&pfd,1,0)>0)
+                {
+                    pthread_mutex_unlock(&sync_mutex);
+                    drop_outgoing(peer,sock_fd);
+                    pthread_mutex_lock(&sync_mutex);
+                }
+            }
+            pthread_mutex_unlock(&sync_mutex);
+            cout<<"[SYNC] outgoing connection to tracker "<<peer->id<<" lost, reconnecting"<<endl;
+            continue;
         }
         close(sock_fd);
         sleep(2);
@@ -332,15 +1056,34 @@ void start_sync(const string&file,int trackerId)
         exit(1);
     }
     self_id=trackerId;
+    // new epoch per run: sequence numbers restart at 1
+    sync_epoch=chrono::duration_cast<chrono::microseconds>(chrono::system_clock::now().time_since_epoch()).count();
     if(self_id<0 || self_id>=(int)g_trackers.size())
     {
         cerr<<"[SYNC] Invalid tracker_id "<<self_id<<endl;
         exit(1);
     }
    
-    pthread_t listener_thread,connector_thread;
+    for(int id=0;id<(int)g_trackers.size();id++)
+    {
+        if(id==self_id)
+        continue;
+        Peer* peer=new Peer();
+        peer->id=id;
+        peers.push_back(peer);
+    }
+
+    pthread_t listener_thread;
     pthread_create(&listener_thread,nullptr,sync_listen,nullptr);
     pthread_detach(listener_thread);
-    pthread_create(&connector_thread,nullptr,sync_accept,nullptr);
-    pthread_detach(connector_thread);
+    // a sender and a connector per peer
+    for(Peer* peer : peers)
+    {
+        pthread_t connector_thread,sender_thread;
+        pthread_create(&sender_thread,nullptr,sync_sender,peer);
+        pthread_detach(sender_thread);
+        pthread_create(&connector_thread,nullptr,sync_accept,peer);
+        pthread_detach(connector_thread);
+    }
+    cout<<"[SYNC] Replicating to "<<peers.size()<<" other tracker(s)"<<endl;
 }
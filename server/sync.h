@@ -1,11 +1,48 @@
 #ifndef SYNC_H
 #define SYNC_H
 
+#include<cstdint>
+#include<cstddef>
+#include<functional>
 #include<string>
 
 using namespace std;
+
+// Counters for the outbound replication log drained by the sender thread.
+struct SyncQueueStats
+{
+    size_t depth=0;              // messages the slowest peer has not been sent yet
+    size_t bytes=0;              // bytes the slowest peer has not been sent yet
+    uint64_t oldest_age_us=0;    // how long the oldest unsent message has waited
+    size_t log_entries=0;        // messages retained for catch-up
+    size_t log_bytes=0;
+    uint64_t last_seq=0;         // sequence number of the newest local mutation
+    size_t peers=0;              // other trackers in tracker_info.txt
+    size_t peers_connected=0;
+    uint64_t enqueued=0;
+    uint64_t sent=0;
+    uint64_t evicted=0;          // trimmed from the log before the peer got them
+    uint64_t resumes=0;          // reconnects served from the log
+    uint64_t full_syncs=0;       // reconnects that needed the full state
+    uint64_t batches=0;
+    uint64_t last_batch_msgs=0;
+    uint64_t last_lag_us=0;      // enqueue-to-send time of the last batch's oldest message
+    uint64_t backpressure_waits=0;
+};
+
 void start_sync(const string&file,int trackerId);
-void send_sync(const string& msg);
+// Logs msg to the local WAL (except heartbeats), then appends it to the replication log under
+// the next sequence number and returns without waiting for the network send. Returns the
+// WAL record's LSN (0 if none); without wait_durable the caller must not acknowledge the
+// mutation before wal_durable_lsn() reaches it.
+uint64_t send_sync(const string& msg, bool wait_durable=true);
+SyncQueueStats get_sync_queue_stats();
+// Applies one "SYNC|..." state mutation to the local tracker state. Used for
+// messages from the peer tracker and when replaying snapshots and the WAL.
+void apply_sync_message(const string& command);
+// Emits the whole tracker state as SYNC lines (no trailing newline) that
+// apply_sync_message() turns back into the same state.
+void dump_state_as_sync(const function<void(const string&)>& emit);
 int get_client_port(int trackerId);
 
 #endif
\ No newline at end of file
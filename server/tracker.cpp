@@ -14,15 +14,61 @@
 #include <netinet/in.h>
 
 #include "client_handler.h"
+#include "liveness.h"
+#include "metrics.h"
+#include "persist.h"
+#include "reactor.h"
 #include "sync.h"
 
 using namespace std;
 
 int main(int argc,char* argv[])
 {
-    if(argc!=3)
+    if(argc<3)
     {
-        cerr<<"Usage: ./tracker tracker_info.txt tracker_id\n";
+        cerr<<"Usage: ./tracker tracker_info.txt tracker_id [--mode=reactor|threads] [--workers=N]"
+              " [--data-dir=DIR] [--snapshot-interval=SEC] [--no-persist] [--stats-port=PORT]"
+              " [--client-ttl=SEC]\n";
+        return 1;
+    }
+
+    // reactor: readiness loop + fixed worker pool (default)
+    // threads: one detached thread per client connection
+    string mode="reactor";
+    int workers=4;
+    // state is logged under tracker<id>_data unless --no-persist
+    string data_dir=string("tracker")+argv[2]+"_data";
+    int snapshot_interval=60;
+    // optional loopback HTTP endpoint with the same text as the stats command
+    int stats_port=0;
+    // client addresses without a heartbeat for this long are dropped (0: never)
+    int client_ttl=30;
+    for(int i=3;i<argc;i++)
+    {
+        string arg=argv[i];
+        if(arg.rfind("--mode=",0)==0)
+        mode=arg.substr(7);
+        else if(arg.rfind("--workers=",0)==0)
+        workers=stoi(arg.substr(10));
+        else if(arg.rfind("--data-dir=",0)==0)
+        data_dir=arg.substr(11);
+        else if(arg.rfind("--snapshot-interval=",0)==0)
+        snapshot_interval=stoi(arg.substr(20));
+        else if(arg=="--no-persist")
+        data_dir.clear();
+        else if(arg.rfind("--stats-port=",0)==0)
+        stats_port=stoi(arg.substr(13));
+        else if(arg.rfind("--client-ttl=",0)==0)
+        client_ttl=stoi(arg.substr(13));
+        else
+        {
+            cerr<<"[TRACKER] Unknown option "<<arg<<"\n";
+            return 1;
+        }
+    }
+    if(mode!="reactor" && mode!="threads")
+    {
+        cerr<<"[TRACKER] --mode must be reactor or threads\n";
         return 1;
     }
 
@@ -32,8 +78,24 @@ int main(int argc,char* argv[])
     string file=argv[1];
     int tracker_id=stoi(argv[2]);
 
+    // armed first so the logins replayed below start their TTL too
+    start_liveness(client_ttl);
+
+    // recover persisted state before peers or clients can see this tracker
+    if(!data_dir.empty() && !start_persistence(data_dir,snapshot_interval))
+    {
+        cerr<<"[TRACKER] Could not open data directory "<<data_dir<<"\n";
+        return 1;
+    }
+
     start_sync(file,tracker_id);
 
+    if(stats_port>0 && !start_stats_server(stats_port,tracker_stats))
+    {
+        cerr<<"[TRACKER] Could not open stats port "<<stats_port<<"\n";
+        return 1;
+    }
+
     int listen_port=get_client_port(tracker_id);
     if(listen_port<=0)
     {
@@ -63,7 +125,7 @@ int main(int argc,char* argv[])
         return 1;
     }
 
-    if(listen(server_fd,5)<0)
+    if(listen(server_fd,SOMAXCONN)<0)
     {
         perror("listen");
         close(server_fd);
@@ -72,6 +134,13 @@ int main(int argc,char* argv[])
 
     cout<<"[TRACKER] Listening on port for clients "<<listen_port<<endl;
 
+    if(mode=="reactor")
+    {
+        run_reactor(server_fd,workers);
+        close(server_fd);
+        return 1;
+    }
+
     while(1)
     {
         sockaddr_in caddr;